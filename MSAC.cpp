@@ -1,37 +1,132 @@
 #include "MSAC.h"
 #include "errorNIETO.h"
 #include "lmmin.h"
+#include "msacResiduals.h"
 
 //#ifdef DEBUG_MAP	// if defined, a 2D map will be created (which slows down the process)
 
 using namespace std;
 using namespace cv;
 
+// Inline 3-vector math on plain floats, used in the RANSAC loop instead of cv::Mat temporaries
+static inline void cross3(const float a[3], const float b[3], float c[3])
+{
+	c[0] = a[1]*b[2] - a[2]*b[1];
+	c[1] = a[2]*b[0] - a[0]*b[2];
+	c[2] = a[0]*b[1] - a[1]*b[0];
+}
+static inline void mul3(const float M[9], const float a[3], float b[3])
+{
+	b[0] = M[0]*a[0] + M[1]*a[1] + M[2]*a[2];
+	b[1] = M[3]*a[0] + M[4]*a[1] + M[5]*a[2];
+	b[2] = M[6]*a[0] + M[7]*a[1] + M[8]*a[2];
+}
+static inline void mul3Accurate(const float M[9], const float a[3], float b[3])
+{
+	// Same as the product of cv::Mat: the sums are accumulated in double
+	b[0] = (float)((double)M[0]*a[0] + (double)M[1]*a[1] + (double)M[2]*a[2]);
+	b[1] = (float)((double)M[3]*a[0] + (double)M[4]*a[1] + (double)M[5]*a[2]);
+	b[2] = (float)((double)M[6]*a[0] + (double)M[7]*a[1] + (double)M[8]*a[2]);
+}
+static inline void normalize3(float a[3])
+{
+	// Same as cv::normalize: a null vector stays null
+	double n = sqrt((double)a[0]*a[0] + (double)a[1]*a[1] + (double)a[2]*a[2]);
+	double scale = n > DBL_EPSILON ? 1/n : 0;
+	a[0] = (float)(a[0]*scale);
+	a[1] = (float)(a[1]*scale);
+	a[2] = (float)(a[2]*scale);
+}
+
+/** Orders the line segments by decreasing length, the ties by index*/
+struct MSACLongerLine
+{
+	const float *lengths;
+	bool operator()(int a, int b) const
+	{
+		return lengths[a] > lengths[b] || (lengths[a] == lengths[b] && a < b);
+	}
+};
+
+/** Orders the boxes of the branch and bound by their upper bound, for the heap*/
+struct MSACSmallerUpperBound
+{
+	bool operator()(const MSACBox &a, const MSACBox &b) const
+	{
+		return a.upper < b.upper;
+	}
+};
+
 MSAC::MSAC(void)
 {
 	// Auxiliar variables
-	__a = Mat(3,1,CV_32F);
-	__an = Mat(3,1,CV_32F);
-	__b = Mat(3,1,CV_32F);
-	__bn = Mat(3,1,CV_32F);
-	__li = Mat(3,1,CV_32F);
-	__c = Mat(3,1,CV_32F);	
-
-	__vp = cv::Mat(3,1,CV_32F);
-	__vpAux = cv::Mat(3,1,CV_32F);
+	for(int i=0; i<3*MSAC_BATCH_SIZE; i++)
+		__vpBatch[i] = 0;
+	for(int i=0; i<3; i++)
+		__vpBest[i] = 0;
+	__numLines = 0;
+	__parallel = false;
+	__seed = MSAC_DEFAULT_SEED;
+	__exhaustiveMaxLines = 0;
+	__exhaustiveTopLines = 0;
+	__sampler = SAMPLER_UNIFORM;
+	__boundedScoring = false;
+	__warmStart = false;
+	__budgetIterations = 0;
+	__budgetTicks = 0;
+	__stats.iterations = 0;
+	__stats.elapsedMs = 0;
+	__stats.truncated = false;
+	__stats.optimal = false;
 }
 
 MSAC::~MSAC(void)
 {
 }
-void MSAC::init(int mode, cv::Size imSize, bool verbose)
+void MSAC::setParallel(bool enable)
+{
+	__parallel = enable;
+}
+void MSAC::setExhaustive(int maxLines, int topLines)
+{
+	__exhaustiveMaxLines = maxLines;
+	__exhaustiveTopLines = topLines;
+}
+void MSAC::setSampler(int sampler)
+{
+	__sampler = sampler;
+}
+void MSAC::setBoundedScoring(bool enable)
+{
+	__boundedScoring = enable;
+}
+void MSAC::setWarmStart(bool enable)
+{
+	__warmStart = enable;
+}
+void MSAC::setBudget(int maxIterations, double maxMilliseconds)
+{
+	__budgetIterations = max(maxIterations, 0);
+	__budgetTicks = (int64)(max(maxMilliseconds, 0.0)*1e-3*cv::getTickFrequency());
+}
+const MSACStats &MSAC::getStats() const
+{
+	return __stats;
+}
+void MSAC::init(int mode, cv::Size imSize, bool verbose, uint64 seed)
 {
 	// Arguments
 	__verbose = verbose;
 	__width = imSize.width;
 	__height = imSize.height;
 	__verbose = verbose;
-	__mode = mode;
+	__accumulator = (mode == MODE_ACCUMULATOR);
+	__branchAndBound = (mode == MODE_BRANCH_AND_BOUND);
+	__mode = (__accumulator || __branchAndBound) ? MODE_NIETO : mode;
+	__seed = seed;
+	__rng = cv::RNG(seed);
+	__warmHypotheses.clear();
+	__warmInlierRatio.clear();
 	
 	// MSAC parameters
 	__epsilon = (float)1e-6;
@@ -45,7 +140,7 @@ void MSAC::init(int mode, cv::Size imSize, bool verbose)
 	__minimal_sample_set_dimension = 2;
 
 	// Minimal Sample Set
-	for(int i=0; i<__minimal_sample_set_dimension; ++i) __MSS.push_back(0);
+	__MSS.assign(__minimal_sample_set_dimension, 0);
 	
 	// (Default) Calibration	
 	__K = Mat(3,3,CV_32F);
@@ -55,104 +150,215 @@ void MSAC::init(int mode, cv::Size imSize, bool verbose)
 	__K.at<float>(1,1) = (float)__height;
 	__K.at<float>(1,2) = (float)__height/2;
 	__K.at<float>(2,2) = (float)1;	
+
+	// Accumulator grid, also the region of the branch and bound
+	__accX0 = (float)(-MSAC_ACCUMULATOR_MARGIN*__width);
+	__accY0 = (float)(-MSAC_ACCUMULATOR_MARGIN*__height);
+	__accCols = (int)ceil((1 + 2*MSAC_ACCUMULATOR_MARGIN)*__width/MSAC_ACCUMULATOR_CELL);
+	__accRows = (int)ceil((1 + 2*MSAC_ACCUMULATOR_MARGIN)*__height/MSAC_ACCUMULATOR_CELL);
+
+	// Plain float copies of K and its inverse for the RANSAC loop
+	cv::Mat Kinv = __K.inv();
+	for(int i=0; i<9; i++)
+	{
+		__Kf[i] = __K.at<float>(i/3, i%3);
+		__Kinv[i] = Kinv.at<float>(i/3, i%3);
+	}
 }
 
 // COMPUTE VANISHING POINTS
-void MSAC::fillDataContainers(std::vector<std::vector<cv::Point> > &lineSegments)
+void MSAC::fillDataContainers(const std::vector<std::vector<cv::Point> > &lineSegments)
 {
+	// The containers keep their capacity between calls
 	int numLines = (int)lineSegments.size();
-	if(__verbose)
-		printf("Line segments: %d\n", numLines);
-
-	// Transform all line segments
-	// __Li = [l_00 l_01 l_02; l_10 l_11 l_12; l_20 l_21 l_22; ...]; where li=[l_i0;l_i1;l_i2]^T is li=an x bn; 
-	__Li = Mat(numLines, 3, CV_32F);
-	__Mi = Mat(numLines, 3, CV_32F);
-	__Lengths = Mat(numLines, numLines, CV_32F);
-	__Lengths.setTo(0);
+	__numLines = numLines;
+	__lx.resize(numLines);
+	__ly.resize(numLines);
+	__lz.resize(numLines);
+	__mx.resize(numLines);
+	__my.resize(numLines);
+	__lengths.resize(numLines);
+	__rawLengths.resize(numLines);
+	__lNorm.resize(numLines);
+	__nNorm.resize(numLines);
+	__lineIndex.resize(numLines);
 
-	// Fill data containers (__Li, __Mi, __Lenghts)
-	double sum_lengths = 0;
 	for (int i=0; i<numLines; i++)
 	{
-		// Extract the end-points					
 		Point p1 = lineSegments[i][0];
 		Point p2 = lineSegments[i][1];
-		__a.at<float>(0,0) = (float)p1.x;
-		__a.at<float>(1,0) = (float)p1.y;
-		__a.at<float>(2,0) = 1;
-		__b.at<float>(0,0) = (float)p2.x;
-		__b.at<float>(1,0) = (float)p2.y;
-		__b.at<float>(2,0) = 1;
-
-		if(__mode == MODE_NIETO)
-			__c = 0.5*(__a+__b);
-		
-		double length = sqrt((__b.at<float>(0,0)-__a.at<float>(0,0))*(__b.at<float>(0,0)-__a.at<float>(0,0))
-			+ (__b.at<float>(1,0)-__a.at<float>(1,0))*(__b.at<float>(1,0)-__a.at<float>(1,0)));
-		sum_lengths += length;
-		__Lengths.at<float>(i,i) = (float)length;
-				
-		if(__mode == MODE_LS)
-		{
-			// Normalize into the sphere
-			__an = __K.inv()*__a;
-			__bn = __K.inv()*__b;					
-		}
-		else // __mode == MODE_NIETO requires not to calibrate into the sphere
-		{
-			__an = __a;
-			__bn = __b;
-		}
+		setLineSegment(i, (float)p1.x, (float)p1.y, (float)p2.x, (float)p2.y);
+	}
+	normalizeLengths();
+}
+void MSAC::fillDataContainers(const std::vector<cv::Vec4i> &lines)
+{
+	int numLines = (int)lines.size();
+	__numLines = numLines;
+	__lx.resize(numLines);
+	__ly.resize(numLines);
+	__lz.resize(numLines);
+	__mx.resize(numLines);
+	__my.resize(numLines);
+	__lengths.resize(numLines);
+	__rawLengths.resize(numLines);
+	__lNorm.resize(numLines);
+	__nNorm.resize(numLines);
+	__lineIndex.resize(numLines);
 
-		// Compute the general form of the line
-		__li = __an.cross(__bn);		
-		cv::normalize(__li,__li);
+	for (int i=0; i<numLines; i++)
+		setLineSegment(i, (float)lines[i][0], (float)lines[i][1], (float)lines[i][2], (float)lines[i][3]);
+	normalizeLengths();
+}
+void MSAC::setLineSegment(int i, float x1, float y1, float x2, float y2)
+{
+	float a[3] = {x1, y1, 1};
+	float b[3] = {x2, y2, 1};
 
-		// Insert line into appended array
-		__Li.at<float>(i,0) = __li.at<float>(0,0);
-		__Li.at<float>(i,1) = __li.at<float>(1,0);
-		__Li.at<float>(i,2) = __li.at<float>(2,0);
+	__rawLengths[i] = sqrt((b[0]-a[0])*(b[0]-a[0]) + (b[1]-a[1])*(b[1]-a[1]));
+	__lineIndex[i] = i;
 
-		if( __mode == MODE_NIETO )
+	// Transform the line segment: li=[lx_i;ly_i;lz_i] is li=an x bn
+	float an[3], bn[3];
+	if(__mode == MODE_LS)
+	{
+		// Normalize into the sphere
+		mul3(__Kinv, a, an);
+		mul3(__Kinv, b, bn);
+	}
+	else // __mode == MODE_NIETO requires not to calibrate into the sphere
+	{
+		for(int k=0; k<3; k++)
 		{
-			// Store mid-Point too
-			__Mi.at<float>(i,0) = __c.at<float>(0,0);
-			__Mi.at<float>(i,1) = __c.at<float>(1,0);
-			__Mi.at<float>(i,2) = __c.at<float>(2,0);
+			an[k] = a[k];
+			bn[k] = b[k];
 		}
-	}	
-	__Lengths = __Lengths*((double)1/sum_lengths);
+	}
+
+	// Compute the general form of the line
+	float li[3];
+	cross3(an, bn, li);
+	normalize3(li);
+
+	__lx[i] = li[0];
+	__ly[i] = li[1];
+	__lz[i] = li[2];
+	__lNorm[i] = sqrt(li[0]*li[0] + li[1]*li[1] + li[2]*li[2]);
+	__nNorm[i] = sqrt(li[0]*li[0] + li[1]*li[1]);
+
+	// Mid-Point (its homogeneous coordinate is always 1)
+	__mx[i] = 0.5f*(a[0] + b[0]);
+	__my[i] = 0.5f*(a[1] + b[1]);
+}
+void MSAC::normalizeLengths()
+{
+	double sum_lengths = 0;
+	for (int i=0; i<__numLines; i++)
+		sum_lengths += __rawLengths[i];
+	for (int i=0; i<__numLines; i++)
+		__lengths[i] = (float)((float)__rawLengths[i]*((double)1/sum_lengths));
 }
-void MSAC::multipleVPEstimation(std::vector<std::vector<cv::Point> > &lineSegments, std::vector<std::vector<std::vector<cv::Point> > > &lineSegmentsClusters, std::vector<int> &numInliers, std::vector<cv::Mat> &vps, int numVps)
+void MSAC::removeConsensusSet(int vpNum)
+{
+	// Stable compaction of the structure of arrays, the line segments keep their order
+	int n = 0;
+	for (int i=0; i<__numLines; i++)
+	{
+		if(__CS_best[i] == vpNum)
+			continue;
+		__lx[n] = __lx[i];
+		__ly[n] = __ly[i];
+		__lz[n] = __lz[i];
+		__mx[n] = __mx[i];
+		__my[n] = __my[i];
+		__rawLengths[n] = __rawLengths[i];
+		__lNorm[n] = __lNorm[i];
+		__nNorm[n] = __nNorm[i];
+		__lineIndex[n] = __lineIndex[i];
+		n++;
+	}
+	__numLines = n;
+	__lx.resize(n);
+	__ly.resize(n);
+	__lz.resize(n);
+	__mx.resize(n);
+	__my.resize(n);
+	__lengths.resize(n);
+	__rawLengths.resize(n);
+	__lNorm.resize(n);
+	__nNorm.resize(n);
+	__lineIndex.resize(n);
+	normalizeLengths();
+}
+void MSAC::multipleVPEstimation(const std::vector<std::vector<cv::Point> > &lineSegments, std::vector<std::vector<std::vector<cv::Point> > > &lineSegmentsClusters, std::vector<int> &numInliers, std::vector<cv::Mat> &vps, int numVps)
+{
+	fillDataContainers(lineSegments);
+	estimateVPs(__clusterIndices, __clusterOffsets, numInliers, vps, numVps);
+
+	// Copy the line segments of each Consensus Set
+	for(int c=0; c+1<(int)__clusterOffsets.size(); c++)
+	{
+		lineSegmentsClusters.push_back(std::vector<std::vector<cv::Point> >());
+		std::vector<std::vector<cv::Point> > &cluster = lineSegmentsClusters.back();
+		for(int k=__clusterOffsets[c]; k<__clusterOffsets[c+1]; k++)
+			cluster.push_back(lineSegments[__clusterIndices[k]]);
+	}
+}
+void MSAC::multipleVPEstimation(const std::vector<cv::Vec4i> &lines, std::vector<int> &clusterIndices, std::vector<int> &clusterOffsets, std::vector<int> &numInliers, std::vector<cv::Mat> &vps, int numVps)
+{
+	fillDataContainers(lines);
+	estimateVPs(clusterIndices, clusterOffsets, numInliers, vps, numVps);
+}
+void MSAC::estimateVPs(std::vector<int> &clusterIndices, std::vector<int> &clusterOffsets, std::vector<int> &numInliers, std::vector<cv::Mat> &vps, int numVps)
 {	
-	// Make a copy of lineSegments because it is modified in the code (it will be restored at the end of this function)
-	std::vector<std::vector<cv::Point> > lineSegmentsCopy = lineSegments;
+	clusterIndices.clear();
+	clusterOffsets.assign(1, 0);
+
+	int64 startTicks = cv::getTickCount();
+	__stats.iterations = 0;
+	__stats.truncated = false;
+	__stats.optimal = __branchAndBound;
 
 	// Loop over maximum number of vanishing points	
 	int number_of_inliers = 0;
 	for(int vpNum=0; vpNum < numVps; vpNum++)
 	{
-		// Fill data structures
-		fillDataContainers(lineSegments);
-		int numLines = (int)lineSegments.size();
+		// The data containers only hold the line segments left by the previous vanishing points
+		int numLines = __numLines;
 
 		if(__verbose)
+		{
 			printf("VP %d-----\n", vpNum);		
+			printf("Line segments: %d\n", numLines);
+		}
 
 		// Break if the number of elements is lower than minimal sample set		
 		if(numLines < 3 || numLines < __minimal_sample_set_dimension)
 		{
 			if(__verbose)
 				printf("Not enough line segments to compute vanishing point\n");
+			if((int)__warmHypotheses.size() > vpNum)
+			{
+				__warmHypotheses.resize(vpNum);
+				__warmInlierRatio.resize(vpNum);
+			}
 			break;
 		}	
 
-		// Vector containing indexes for current vp
-		std::vector<int> ind_CS;
-		
+		// Out of time, the remaining vanishing points are not searched
+		if(vpNum > 0 && __budgetTicks > 0 && cv::getTickCount() - startTicks > __budgetTicks)
+		{
+			if(__verbose)
+				printf("Out of time budget before VP %d\n", vpNum);
+			__stats.truncated = true;
+			__stats.optimal = false;
+			break;
+		}
+
 		__N_I_best = __minimal_sample_set_dimension;
 		__J_best = FLT_MAX;			
+		for(int k=0; k<3; k++)
+			__vpBest[k] = 0;
 
 		int iter = 0;
 		int T_iter = INT_MAX;
@@ -160,11 +366,30 @@ void MSAC::multipleVPEstimation(std::vector<std::vector<cv::Point> > &lineSegmen
 		int max_no_updates = INT_MAX;		
 
 		// Define containers of CS (Consensus set): __CS_best to store the best one, and __CS_idx to evaluate a new candidate
-		__CS_best = vector<int>(numLines, 0);
-		__CS_idx = vector<int>(numLines, 0);
+		__CS_best.assign(numLines, 0);
+		__CS_idx.assign(numLines, 0);
 
 		// Allocate Error matrix
-		vector<float> E = vector<float>(numLines, 0);		
+		vector<float> &E = __E;
+		E.assign(MSAC_BATCH_SIZE*numLines, 0);
+		int batchSize = 0, batchNext = 0;
+		bool findBestCS = false;		// The CS of the best hypothesis is found after the search
+		bool search = __accumulator || __branchAndBound;
+		bool exhaustive = !search && __exhaustiveMaxLines > 0 && numLines <= __exhaustiveMaxLines;
+		bool sampling = !search && !exhaustive;
+		if(__sampler == SAMPLER_PROSAC && sampling)
+			initProsac();
+		if(__boundedScoring)
+			initBoundedScoring();
+
+		// The hypotheses of the previous call are the first batch
+		int numWarm = 0;
+		if(__warmStart && sampling && (int)__warmHypotheses.size() > vpNum)
+			numWarm = (int)__warmHypotheses[vpNum].size()/3;
+		int hypOffset = numWarm;		// The random hypotheses are numbered after them
+		bool warmBatch = false;
+		int T_warm = INT_MAX;
+		__acceptedHypotheses.clear();
 
 		// MSAC
 		if(__verbose)
@@ -174,27 +399,117 @@ void MSAC::multipleVPEstimation(std::vector<std::vector<cv::Point> > &lineSegmen
 			if(__mode == MODE_NIETO)
 				printf("Method: Nieto\n");
 
-			printf("Start MSAC\n");
+			if(__accumulator)
+				printf("Start accumulator\n");
+			else if(__branchAndBound)
+				printf("Start branch and bound\n");
+			else
+				printf(exhaustive ? "Start exhaustive search\n" : "Start MSAC\n");
+		}
+
+		// Exhaustive search, accumulator or branch and bound, instead of the RANSAC loop
+		if(exhaustive)
+			iter = searchAllPairs(vpNum, &findBestCS);
+		else if(__accumulator)
+			iter = voteAccumulator(vpNum, &findBestCS);
+		else if(__branchAndBound)
+		{
+			bool optimal = false;
+			iter = branchAndBound(vpNum, startTicks, &findBestCS, &optimal);
+			if(!optimal)
+				__stats.optimal = false;
 		}
 
 		// RANSAC loop
-		while ( (iter <= __min_iters) || ((iter<=T_iter) && (iter <=__max_iters) && (no_updates <= max_no_updates)) )
+		while ( sampling && ((iter <= __min_iters) || ((iter<=min(T_iter, T_warm)) && (iter <=__max_iters) && (no_updates <= max_no_updates))) )
 		{					
 			iter++;
 
 			if(iter >= __max_iters)
 				break;
 
-			// Hypothesize ------------------------
-			// Select MSS				
-			if(__Li.rows < (int)__MSS.size())
+			// The budget stops the search with the best hypothesis so far
+			if(__budgetIterations > 0 && iter > __budgetIterations)
+			{
+				iter--;
+				__stats.truncated = true;
 				break;
-			GetMinimalSampleSet(__Li, __Lengths, __Mi, __MSS, __vpAux);		// output __vpAux is calibrated						
+			}
+
+			// Hypothesize ------------------------
+			if(batchNext == batchSize)
+			{
+				// Select the MSS of a batch of hypotheses and compute all their residuals in one pass,
+				// the hypotheses left when the loop ends are just dropped
+				if(__numLines < (int)__MSS.size())
+					break;
+				if(iter > 1 && __budgetTicks > 0 && cv::getTickCount() - startTicks > __budgetTicks)
+				{
+					iter--;
+					__stats.truncated = true;
+					break;
+				}
+				if(warmBatch)
+				{
+					// Cut the sampling if the previous hypotheses still explain the line segments
+					warmBatch = false;
+					if(__N_I_best >= MSAC_WARM_START_RATIO*__warmInlierRatio[vpNum]*numLines)
+						T_warm = iter - 1 + MSAC_WARM_START_ITERATIONS;
+					if(__verbose)
+						printf("Warm start %s\n", T_warm < INT_MAX ? "accepted" : "rejected, full MSAC");
+				}
+
+				if(numWarm > 0)
+				{
+					batchSize = numWarm;
+					for(int k=0; k<3*numWarm; k++)
+						__vpBatch[k] = __warmHypotheses[vpNum][k];
+					scoreHypotheses(__vpBatch, batchSize, &E[0], __batchJ, __batchN_I, __batchComplete);
+					numWarm = 0;
+					warmBatch = true;
+				}
+				else if(__parallel)
+				{
+					// The hypotheses are numbered by the iteration, the batch is scored by the threads
+					// and then taken in order below, as if it was sequential
+					batchSize = MSAC_PARALLEL_BATCH_SIZE;
+					scoreBatchParallel(vpNum, iter - 1 - hypOffset);
+				}
+				else
+				{
+					for(batchSize=0; batchSize<MSAC_BATCH_SIZE; batchSize++)
+						GetMinimalSampleSet(iter - 1 - hypOffset + batchSize, __MSS, &__vpBatch[3*batchSize]);		// output is calibrated
+					scoreHypotheses(__vpBatch, batchSize, &E[0], __batchJ, __batchN_I, __batchComplete);
+				}
+				batchNext = 0;
+			}
 
 			// Test --------------------------------
 			// Find the consensus set and cost	
+			const float *vpAux;
 			int N_I = 0;
-			float J = GetConsensusSet(vpNum, __Li, __Lengths, __Mi, __vpAux, E, &N_I);		// the CS is indexed in CS_idx		
+			float J;
+			bool parallelBatch = __parallel && !warmBatch;
+			if(parallelBatch)
+			{
+				// Already scored, the CS of the best hypothesis is found after the loop
+				vpAux = &__vpParallel[3*batchNext];
+				J = __J_parallel[batchNext];
+				N_I = __N_I_parallel[batchNext];
+			}
+			else if(__batchComplete[batchNext])
+			{
+				vpAux = &__vpBatch[3*batchNext];
+				J = GetConsensusSet(vpNum, vpAux, &E[batchNext*numLines], &N_I);		// the CS is indexed in CS_idx		
+			}
+			else
+			{
+				// Stopped by the bounded scoring, it can not win
+				vpAux = &__vpBatch[3*batchNext];
+				J = __batchJ[batchNext];
+				N_I = __batchN_I[batchNext];
+			}
+			batchNext++;
 
 			// Update ------------------------------
 			// If the new cost is better than the best one, update
@@ -203,16 +518,32 @@ void MSAC::multipleVPEstimation(std::vector<std::vector<cv::Point> > &lineSegmen
 				__notify = true;
 
 				__J_best = J;
-				__CS_best = __CS_idx; 
-
-				__vp = __vpAux;			// Store into __vp (current best hypothesis): __vp is therefore calibrated								
+				if(parallelBatch)
+					findBestCS = true;
+				else
+					__CS_best = __CS_idx; 
+
+				for(int k=0; k<3; k++)
+					__vpBest[k] = vpAux[k];	// Store into __vpBest (current best hypothesis): __vpBest is therefore calibrated								
+
+				// Keep the last best hypotheses for the warm start of the next call
+				__acceptedHypotheses.insert(__acceptedHypotheses.end(), vpAux, vpAux + 3);
+				if((int)__acceptedHypotheses.size() > 3*(MSAC_WARM_START_HYPOTHESES - 1))
+					__acceptedHypotheses.erase(__acceptedHypotheses.begin(), __acceptedHypotheses.begin() + 3);
 										
 				if (N_I > __N_I_best)			
 					__update_T_iter = true;					
 
 				__N_I_best = N_I;
 
-				if (__update_T_iter)
+				if (__update_T_iter && __sampler == SAMPLER_PROSAC)
+				{
+					// The PROSAC criterion needs the consensus set, the parallel mode does not keep it
+					if(parallelBatch)
+						GetBestConsensusSet(vpNum);
+					T_iter = prosacIterations(vpNum);
+				}
+				else if (__update_T_iter)
 				{
 					// Update number of iterations
 					double q = 0;
@@ -249,7 +580,7 @@ void MSAC::multipleVPEstimation(std::vector<std::vector<cv::Point> > &lineSegmen
 				printf("Inliers = %6d/%6d (cost is J = %8.4f)\n", __N_I_best, numLines, __J_best);
 
 				if(__verbose)
-					printf("MSS Cal.VP = (%.3f,%.3f,%.3f)\n", __vp.at<float>(0,0), __vp.at<float>(1,0), __vp.at<float>(2,0));				
+					printf("MSS Cal.VP = (%.3f,%.3f,%.3f)\n", __vpBest[0], __vpBest[1], __vpBest[2]);				
 			}
 
 			// Check CS length (for the case all line segments are in the CS)
@@ -261,25 +592,38 @@ void MSAC::multipleVPEstimation(std::vector<std::vector<cv::Point> > &lineSegmen
 			}
 		}
 		
+		// The consensus set of the best hypothesis of the parallel, exhaustive, accumulator and branch and bound modes
+		if(findBestCS)
+			GetBestConsensusSet(vpNum);
+
+		// The final vanishing point (calibrated) for the warm start, the reestimated one if any
+		float vpFinal[3] = {__vpBest[0], __vpBest[1], __vpBest[2]};
+
 		// Reestimate ------------------------------
+		__stats.iterations += iter;
 		if(__verbose)
 		{
-			printf("Number of iterations: %d\n", iter);
+			printf("Number of iterations: %d%s\n", iter, __stats.truncated ? " (truncated)" : "");
 			printf("Final number of inliers = %d/%d\n", __N_I_best, numLines); 			
 		}			
 
-		// Fill ind_CS with __CS_best
-		std::vector<std::vector<cv::Point> > lineSegmentsCurrent;
+		// The best hypothesis, as the output vanishing point
+		float vp[3] = {__vpBest[0], __vpBest[1], __vpBest[2]};
+
+		// Fill ind_CS with __CS_best, and the current cluster with the indexes in the input
+		std::vector<int> &ind_CS = __indCS;
+		ind_CS.clear();
 		for(int i=0; i<numLines; i++)
 		{
 			if(__CS_best[i] == vpNum)
 			{
-				int a = i;
-				ind_CS.push_back(a);
-				lineSegmentsCurrent.push_back(lineSegments[i]);
+				ind_CS.push_back(i);
+				clusterIndices.push_back(__lineIndex[i]);
 			}
 		}
+		clusterOffsets.push_back((int)clusterIndices.size());
 	
+		bool output = false;
 		if(__J_best > 0 && ind_CS.size() > (unsigned int)__minimal_sample_set_dimension) // if J==0 maybe its because all line segments are perfectly parallel and the vanishing point is at the infinity
 		{		
 			if(__verbose)
@@ -289,142 +633,839 @@ void MSAC::multipleVPEstimation(std::vector<std::vector<cv::Point> > &lineSegmen
 			}
 
 			if(__mode == MODE_LS)
-				estimateLS(__Li, __Lengths, ind_CS, __N_I_best, __vp);			
+				estimateLS(ind_CS, __N_I_best, vp);			
 			else if(__mode == MODE_NIETO)
-				estimateNIETO(__Li, __Lengths, __Mi, ind_CS, __N_I_best, __vp);	// Output __vp is calibrated
+				estimateNIETO(ind_CS, __N_I_best, vp);	// Output vp is calibrated
 			else
 				perror("ERROR: mode not supported, please use {LS, LIEB, NIETO}\n");
+			for(int k=0; k<3; k++)
+				vpFinal[k] = vp[k];
+			normalize3(vpFinal);
 			
 			if(__verbose)			
 				printf("done!\n");							
+			output = true;
+		}
+		else if(fabs(__J_best - 1) < 0.000001)
+		{
+			if(__verbose)
+				printf("The cost of the best MSS is 0! No need to reestimate\n");
+			output = true;
+		}		
 
+		if(output)
+		{
 			// Uncalibrate		
 			if(__verbose)
-				printf("Cal.VP = (%.3f,%.3f,%.3f)\n", __vp.at<float>(0,0), __vp.at<float>(1,0), __vp.at<float>(2,0));
-			__vp = __K*__vp;
-			if(__vp.at<float>(2,0) != 0)
-			{
-				__vp.at<float>(0,0) /= __vp.at<float>(2,0);
-				__vp.at<float>(1,0) /= __vp.at<float>(2,0);
-				__vp.at<float>(2,0) = 1;					
-			}	
-			else
+				printf("Cal.VP = (%.3f,%.3f,%.3f)\n", vp[0], vp[1], vp[2]);
+			float vpUnc[3];
+			mul3Accurate(__Kf, vp, vpUnc);
+			if(vpUnc[2] != 0)
 			{
-				// Since this is infinite, it is better to leave it calibrated
-				__vp = __K.inv()*__vp;
+				vp[0] = vpUnc[0]/vpUnc[2];
+				vp[1] = vpUnc[1]/vpUnc[2];
+				vp[2] = 1;
 			}
+			// else, since this is infinite, it is better to leave it calibrated
 			if(__verbose)
-				printf("VP = (%.3f,%.3f,%.3f)\n", __vp.at<float>(0,0), __vp.at<float>(1,0), __vp.at<float>(2,0));			
+				printf("VP = (%.3f,%.3f,%.3f)\n", vp[0], vp[1], vp[2]);			
 			
-			// Copy to output vector
-			vps.push_back(__vp);	
+			// Copy to output vector, the matrix of vpNum is allocated by the first call and then reused
+			if((int)__vpOutputs.size() <= vpNum)
+				__vpOutputs.resize(vpNum + 1);
+			cv::Mat &vpOut = __vpOutputs[vpNum];
+			if(vpOut.empty())
+				vpOut = cv::Mat(3,1,CV_32F);
+			for(int k=0; k<3; k++)
+				vpOut.at<float>(k,0) = vp[k];
+			vps.push_back(vpOut);	
 		}
-		else if(fabs(__J_best - 1) < 0.000001)
+
+		// Remove the inliers of the current vps from the data
+		if(__N_I_best > 2)
+			removeConsensusSet(vpNum);
+
+		// Fill numInliers
+		numInliers.push_back(__N_I_best);		
+
+		// Warm start of the next call
+		if(__warmStart)
 		{
-			if(__verbose)
+			if((int)__warmHypotheses.size() <= vpNum)
 			{
-				printf("The cost of the best MSS is 0! No need to reestimate\n");
-				printf("Cal. VP = (%.3f,%.3f,%.3f)\n", __vp.at<float>(0,0), __vp.at<float>(1,0), __vp.at<float>(2,0));			
+				__warmHypotheses.resize(vpNum + 1);
+				__warmInlierRatio.resize(vpNum + 1);
 			}
-								
-			// Uncalibrate
-			__vp = __K*__vp;
-			if(__vp.at<float>(2,0) != 0)
+			std::vector<float> &warm = __warmHypotheses[vpNum];
+			warm.assign(vpFinal, vpFinal + 3);
+			warm.insert(warm.end(), __acceptedHypotheses.begin(), __acceptedHypotheses.end());
+			__warmInlierRatio[vpNum] = (float)__N_I_best/numLines;
+		}
+	}
+
+	__stats.elapsedMs = (cv::getTickCount() - startTicks)*1e3/cv::getTickFrequency();
+}
+// RANSAC
+void MSAC::GetMinimalSampleSet(int hypNum, std::vector<int> &MSS, float vp[3])
+{	
+	int N = __numLines;	
+	int n = prosacSubsetSize(hypNum);
+
+	if(n <= N)
+	{
+		// PROSAC: the n-th longest line segment with one of the n-1 longer ones
+		MSS[0] = __prosacOrder[n-1];
+		MSS[1] = __prosacOrder[__rng.uniform(0, n-1)];
+	}
+	else
+	{
+		// Generate a pair of different samples	
+		MSS[0] = __rng.uniform(0, N);
+		while ((MSS[1] = __rng.uniform(0, N)) == MSS[0]);
+	}
+
+	// Estimate the vanishing point
+	estimateMinimal(MSS[0], MSS[1], vp);
+}
+
+// Parallel mode ------------------------------------------------------------------------------------
+// Each hypothesis has its own MSS, drawn from a counter-based generator keyed by (seed, vpNum, hypNum), so it
+// does not matter which thread scores it. The batches are split into groups of MSAC_BATCH_SIZE hypotheses,
+// each group is one pass of computeResiduals over the line segments.
+class MSACHypothesesBody : public cv::ParallelLoopBody
+{
+public:
+	MSACHypothesesBody(MSAC *msac, int vpNum, int firstHyp)
+		: __msac(msac), __vpNum(vpNum), __firstHyp(firstHyp)
+	{
+	}
+
+	void operator()(const cv::Range &range) const
+	{
+		__msac->scoreGroupsParallel(__vpNum, __firstHyp, range.start, range.end);
+	}
+
+private:
+	MSAC *__msac;
+	int __vpNum;
+	int __firstHyp;
+};
+
+/** splitmix64, a 64 bit mixing function with good statistics for consecutive inputs*/
+static inline uint64 splitMix64(uint64 x)
+{
+	x += CV_BIG_UINT(0x9E3779B97F4A7C15);
+	x = (x ^ (x >> 30))*CV_BIG_UINT(0xBF58476D1CE4E5B9);
+	x = (x ^ (x >> 27))*CV_BIG_UINT(0x94D049BB133111EB);
+	return x ^ (x >> 31);
+}
+
+void MSAC::GetMinimalSampleSetCounter(int vpNum, int hypNum, float vp[3]) const
+{
+	uint64 N = (uint64)__numLines;
+	uint64 counter = ((uint64)(unsigned int)vpNum << 32) | (unsigned int)hypNum;
+	uint64 r = splitMix64(splitMix64(__seed) ^ counter);
+
+	// Two different line segments, from the upper and the lower 32 bits
+	int i, j;
+	int n = prosacSubsetSize(hypNum);
+	if(n <= __numLines)
+	{
+		i = __prosacOrder[n-1];
+		j = __prosacOrder[(int)(((r & 0xFFFFFFFF)*(uint64)(n - 1)) >> 32)];
+	}
+	else
+	{
+		i = (int)(((r >> 32)*N) >> 32);
+		j = (int)(((r & 0xFFFFFFFF)*(N - 1)) >> 32);
+		if(j >= i)
+			j++;
+	}
+
+	estimateMinimal(i, j, vp);
+}
+
+void MSAC::scoreBatchParallel(int vpNum, int firstHyp)
+{
+	__vpParallel.resize(3*MSAC_PARALLEL_BATCH_SIZE);
+	__J_parallel.resize(MSAC_PARALLEL_BATCH_SIZE);
+	__N_I_parallel.resize(MSAC_PARALLEL_BATCH_SIZE);
+	__E_parallel.resize(MSAC_PARALLEL_BATCH_SIZE*__numLines);
+
+	MSACHypothesesBody body(this, vpNum, firstHyp);
+	cv::parallel_for_(cv::Range(0, MSAC_PARALLEL_BATCH_SIZE/MSAC_BATCH_SIZE), body);
+}
+
+void MSAC::scoreGroupsParallel(int vpNum, int firstHyp, int groupBegin, int groupEnd)
+{
+	// Only the entries of the hypotheses of the groups are written, the rest of the object is read only
+	for(int g=groupBegin; g<groupEnd; g++)
+	{
+		int h0 = g*MSAC_BATCH_SIZE;
+		for(int h=h0; h<h0+MSAC_BATCH_SIZE; h++)
+			GetMinimalSampleSetCounter(vpNum, firstHyp + h, &__vpParallel[3*h]);		// output is calibrated
+		bool complete[MSAC_BATCH_SIZE];
+		scoreHypotheses(&__vpParallel[3*h0], MSAC_BATCH_SIZE, &__E_parallel[h0*__numLines], &__J_parallel[h0], &__N_I_parallel[h0], complete);
+
+		for(int h=h0; h<h0+MSAC_BATCH_SIZE; h++)
+		{
+			if(!complete[h - h0])
+				continue;
+			int N_I = 0;
+			__J_parallel[h] = GetCost(vpNum, &__vpParallel[3*h], &__E_parallel[h*__numLines], &N_I);
+			__N_I_parallel[h] = N_I;
+		}
+	}
+}
+
+// PROSAC -------------------------------------------------------------------------------------------
+// Chum and Matas, "Matching with PROSAC - Progressive Sample Consensus", CVPR 2005. The line segments are
+// ranked by length, the hypothesis t is drawn from the n longest ones where n grows with t as in the paper.
+// T_N is the number of different MSS, so the n-th line segment is paired about once with each longer one
+// before the next enters, after T_N samples the sampling is uniform. The growth only depends on t, so the
+// parallel mode draws the same subsets.
+void MSAC::initProsac()
+{
+	int N = __numLines;
+	int m = __minimal_sample_set_dimension;
+
+	__prosacOrder.resize(N);
+	for(int i=0; i<N; i++)
+		__prosacOrder[i] = i;
+	MSACLongerLine longer;
+	longer.lengths = &__lengths[0];
+	std::sort(__prosacOrder.begin(), __prosacOrder.end(), longer);
+
+	// T'_n, the first n=m line segments are sampled once
+	__prosacGrowth.assign(N+1, 0);
+	double T_N = 1;
+	for(int i=0; i<m; i++)
+		T_N *= (double)(N - i)/(double)(i + 1);
+	double T_n = T_N;
+	for(int i=0; i<m; i++)
+		T_n *= (double)(m - i)/(double)(N - i);
+	int growth = 1;
+	__prosacGrowth[m] = growth;
+	for(int n=m; n<N; n++)
+	{
+		double T_n1 = T_n*(n + 1)/(n + 1 - m);
+		growth += (int)ceil(T_n1 - T_n);
+		__prosacGrowth[n+1] = growth;
+		T_n = T_n1;
+	}
+
+	// Non-randomness: the m line segments of the MSS are always inliers, each of the other n-m is an inlier
+	// of a wrong vanishing point with probability beta
+	__prosacIMin.assign(N+1, INT_MAX);
+	double beta = MSAC_PROSAC_BETA;
+	for(int n=m; n<=N; n++)
+	{
+		int k = n - m;
+		double pmf = pow(1 - beta, k);	// P(j inliers) for j=0
+		double cdf = 0;
+		for(int j=1; j<=k; j++)
+		{
+			cdf += pmf;
+			if(1 - cdf < MSAC_PROSAC_PSI)
 			{
-				__vp.at<float>(0,0) /= __vp.at<float>(2,0);
-				__vp.at<float>(1,0) /= __vp.at<float>(2,0);
-				__vp.at<float>(2,0) = 1;				
+				__prosacIMin[n] = m + j;
+				break;
+			}
+			pmf *= (double)(k - j + 1)/j*beta/(1 - beta);
+		}
+	}
+}
 
-				if(__verbose)
-					printf("VP = (%.3f,%.3f,%.3f)\n", __vp.at<float>(0,0), __vp.at<float>(1,0), __vp.at<float>(2,0));			
-			}	
-			else
+int MSAC::prosacSubsetSize(int hypNum) const
+{
+	if(__sampler != SAMPLER_PROSAC)
+		return INT_MAX;
+
+	// The smallest n with T'_n >= t, for the samples t = 1, 2, ...
+	int t = hypNum + 1;
+	std::vector<int>::const_iterator it = std::lower_bound(__prosacGrowth.begin() + __minimal_sample_set_dimension, __prosacGrowth.end(), t);
+	if(it == __prosacGrowth.end())
+		return INT_MAX;
+	return (int)(it - __prosacGrowth.begin());
+}
+
+int MSAC::prosacIterations(int vpNum) const
+{
+	// Maximality: an all-inlier MSS of the n longest line segments has been drawn with probability 1-epsilon
+	// after k_n samples of them. The samples up to T'_n are drawn from the n longest line segments, all the
+	// samples are drawn from the N line segments. The subsets with too few inliers are not considered, and
+	// until the consensus set is non-random among all the line segments only k_N is used, as in RANSAC.
+	int N = __numLines;
+	int m = __minimal_sample_set_dimension;
+	int I_N = 0;
+	for(int i=0; i<N; i++)
+		if(__CS_best[i] == vpNum)
+			I_N++;
+	bool nonRandom = I_N >= __prosacIMin[N];
+
+	int T = INT_MAX;
+	int I_n = 0;
+	for(int n=1; n<=N; n++)
+	{
+		if(__CS_best[__prosacOrder[n-1]] == vpNum)
+			I_n++;
+		if(n < m || (n < N && (!nonRandom || I_n < __prosacIMin[n])))
+			continue;
+
+		double q = 1;
+		for(int j=0; j<m; j++)
+			q *= (double)(I_n - j)/(double)(n - j);
+		double k_n = 0;
+		if((1-q) > 1e-12)
+			k_n = ceil(log((double)__epsilon)/log(1 - q));
+		if(k_n >= INT_MAX)
+			continue;
+		if(n == N || (int)k_n <= __prosacGrowth[n])
+			T = min(T, (int)k_n);
+	}
+	return T;
+}
+
+// Exhaustive mode ----------------------------------------------------------------------------------
+
+int MSAC::searchAllPairs(int vpNum, bool *updated)
+{
+	int numLines = __numLines;
+	__pairLines.resize(numLines);
+	for(int i=0; i<numLines; i++)
+		__pairLines[i] = i;
+	int numPairLines = numLines;
+	if(__exhaustiveTopLines > 0 && __exhaustiveTopLines < numLines)
+	{
+		MSACLongerLine longer;
+		longer.lengths = &__lengths[0];
+		std::sort(__pairLines.begin(), __pairLines.end(), longer);
+		numPairLines = __exhaustiveTopLines;
+	}
+
+	// The pairs are scored in batches in a fixed order, the first of the equally good hypotheses wins
+	float *E = &__E[0];
+	int numPairs = 0;
+	int batchSize = 0;
+	for(int a=0; a<numPairLines; a++)
+	{
+		for(int b=a+1; b<numPairLines; b++)
+		{
+			estimateMinimal(__pairLines[a], __pairLines[b], &__vpBatch[3*batchSize]);
+			batchSize++;
+			numPairs++;
+			bool last = (a == numPairLines - 2);
+			if(batchSize < MSAC_BATCH_SIZE && !last)
+				continue;
+
+			scoreHypotheses(__vpBatch, batchSize, E, __batchJ, __batchN_I, __batchComplete);
+			for(int h=0; h<batchSize; h++)
 			{
-				// Calibrate
-				__vp = __K.inv()*__vp;					
-			}	
-			// Copy to output vector
-			vps.push_back(__vp);	
-		}		
+				if(!__batchComplete[h])
+					continue;
+				int N_I = 0;
+				float J = GetCost(vpNum, &__vpBatch[3*h], &E[h*numLines], &N_I);
+				if ((N_I >= __minimal_sample_set_dimension && J < __J_best) || (J == __J_best && N_I > __N_I_best))
+				{
+					__J_best = J;
+					__N_I_best = N_I;
+					for(int k=0; k<3; k++)
+						__vpBest[k] = __vpBatch[3*h + k];
+					*updated = true;
+				}
+			}
+			batchSize = 0;
+		}
+	}
 
-		// Fill lineSegmentsClusters containing the indexes of inliers for current vps
-		if(__N_I_best > 2)
+	if(__verbose && *updated)
+	{
+		printf("Pairs = %d. ", numPairs);
+		printf("Inliers = %6d/%6d (cost is J = %8.4f)\n", __N_I_best, numLines, __J_best);
+		printf("MSS Cal.VP = (%.3f,%.3f,%.3f)\n", __vpBest[0], __vpBest[1], __vpBest[2]);
+	}
+	return numPairs;
+}
+
+int MSAC::voteAccumulator(int vpNum, bool *updated)
+{
+	int numLines = __numLines;
+	int cols = __accCols, rows = __accRows;
+	float cell = (float)MSAC_ACCUMULATOR_CELL;
+	__accVotes.assign(cols*rows, 0);
+	__accSums.assign(cols*rows, 0);
+	float *votes = &__accVotes[0];
+	float *sums = &__accSums[0];
+
+	// Each line segment votes with its length for one cell per column (or row) of its line, the lines of MODE_NIETO
+	// are not calibrated
+	for(int i=0; i<numLines; i++)
+	{
+		float lx = __lx[i], ly = __ly[i], lz = __lz[i], w = __lengths[i];
+		if(fabs(ly) >= fabs(lx))
+		{
+			for(int c=0; c<cols; c++)
+			{
+				float x = __accX0 + (c + 0.5f)*cell;
+				int r = (int)floor((-(lx*x + lz)/ly - __accY0)/cell);
+				if(r >= 0 && r < rows)
+					votes[r*cols + c] += w;
+			}
+		}
+		else
 		{
-			while(ind_CS.size())
+			for(int r=0; r<rows; r++)
 			{
-				lineSegments.erase(lineSegments.begin() + ind_CS[ind_CS.size() - 1]);
-				ind_CS.pop_back();
+				float y = __accY0 + (r + 0.5f)*cell;
+				int c = (int)floor((-(ly*y + lz)/lx - __accX0)/cell);
+				if(c >= 0 && c < cols)
+					votes[r*cols + c] += w;
 			}
 		}
+	}
 
-		// Fill current CS
-		lineSegmentsClusters.push_back(lineSegmentsCurrent);
+	// The line of a line segment may cross the neighbour cell of the vanishing point, so the peaks are searched
+	// on the sums of 3x3 cells
+	for(int r=1; r<rows-1; r++)
+	{
+		for(int c=1; c<cols-1; c++)
+		{
+			float sum = 0;
+			for(int dr=-1; dr<=1; dr++)
+				for(int dc=-1; dc<=1; dc++)
+					sum += votes[(r + dr)*cols + c + dc];
+			sums[r*cols + c] = sum;
+		}
+	}
 
-		// Fill numInliers
-		numInliers.push_back(__N_I_best);		
+	// The highest peaks, their neighbourhood is cleared after each one. The hypothesis is the centroid of the votes
+	int numPeaks = 0;
+	for(; numPeaks<MSAC_BATCH_SIZE; numPeaks++)
+	{
+		int best = -1;
+		for(int k=0; k<cols*rows; k++)
+			if(sums[k] > 0 && (best < 0 || sums[k] > sums[best]))
+				best = k;
+		if(best < 0)
+			break;
+
+		int r0 = best/cols, c0 = best%cols;
+		float x = 0, y = 0;
+		for(int dr=-1; dr<=1; dr++)
+		{
+			for(int dc=-1; dc<=1; dc++)
+			{
+				float w = votes[(r0 + dr)*cols + c0 + dc];
+				x += w*(c0 + dc + 0.5f);
+				y += w*(r0 + dr + 0.5f);
+			}
+		}
+		float p[3] = {__accX0 + x/sums[best]*cell, __accY0 + y/sums[best]*cell, 1};
+		mul3(__Kinv, p, &__vpBatch[3*numPeaks]);
+		normalize3(&__vpBatch[3*numPeaks]);
+
+		for(int r=max(r0 - 2, 0); r<=min(r0 + 2, rows - 1); r++)
+			for(int c=max(c0 - 2, 0); c<=min(c0 + 2, cols - 1); c++)
+				sums[r*cols + c] = 0;
+	}
+
+	// Score the peaks like the random hypotheses, the first of the equally good ones wins
+	float *E = &__E[0];
+	if(numPeaks > 0)
+		scoreHypotheses(__vpBatch, numPeaks, E, __batchJ, __batchN_I, __batchComplete);
+	for(int h=0; h<numPeaks; h++)
+	{
+		if(!__batchComplete[h])
+			continue;
+		int N_I = 0;
+		float J = GetCost(vpNum, &__vpBatch[3*h], &E[h*numLines], &N_I);
+		if ((N_I >= __minimal_sample_set_dimension && J < __J_best) || (J == __J_best && N_I > __N_I_best))
+		{
+			__J_best = J;
+			__N_I_best = N_I;
+			for(int k=0; k<3; k++)
+				__vpBest[k] = __vpBatch[3*h + k];
+			*updated = true;
+		}
 	}
 
-	// Restore lineSegments
-	lineSegments = lineSegmentsCopy;
+	if(__verbose && *updated)
+	{
+		printf("Peaks = %d. ", numPeaks);
+		printf("Inliers = %6d/%6d (cost is J = %8.4f)\n", __N_I_best, numLines, __J_best);
+		printf("Peak Cal.VP = (%.3f,%.3f,%.3f)\n", __vpBest[0], __vpBest[1], __vpBest[2]);
+	}
+	return numPeaks;
 }
-// RANSAC
-void MSAC::GetMinimalSampleSet(cv::Mat &Li, cv::Mat &Lengths, cv::Mat &Mi, std::vector<int> &MSS, cv::Mat &vp)
-{	
-	int N = Li.rows;	
 
-	// Generate a pair of samples	
-	while (N <= (MSS[0] = rand() / (RAND_MAX/(N-1))));
-	while (N <= (MSS[1] = rand() / (RAND_MAX/(N-1))));
+int MSAC::branchAndBound(int vpNum, int64 startTicks, bool *updated, bool *optimal)
+{
+	int maxNodes = __budgetIterations > 0 ? __budgetIterations : MSAC_BNB_MAX_NODES;
+	float minHalfSize = (float)(0.5*MSAC_BNB_MIN_SIZE);
+	MSACSmallerUpperBound order;
+
+	// The region of the accumulator
+	MSACBox root;
+	root.halfWidth = (float)(0.5*__accCols*MSAC_ACCUMULATOR_CELL);
+	root.halfHeight = (float)(0.5*__accRows*MSAC_ACCUMULATOR_CELL);
+	root.x = __accX0 + root.halfWidth;
+	root.y = __accY0 + root.halfHeight;
+	int bestLower = boundBox(root);
+	float bestX = root.x, bestY = root.y;
+	int numNodes = 1;
+	int smallUpper = 0;	// Highest upper bound of the boxes too small to be split, their centers are scored
+	bool truncated = false;
+
+	// Best first: the box with the highest upper bound is split in 4, the boxes that can not beat the best center
+	// are dropped. The search is over when the highest upper bound is the best center
+	__bnbHeap.clear();
+	__bnbHeap.push_back(root);
+	*optimal = false;
+	while(true)
+	{
+		if(__bnbHeap.empty() || __bnbHeap[0].upper <= bestLower)
+		{
+			// A small box may still hold a vanishing point with more inliers than its center
+			*optimal = (smallUpper <= bestLower);
+			break;
+		}
+		if(numNodes >= maxNodes || (__budgetTicks > 0 && cv::getTickCount() - startTicks > __budgetTicks))
+		{
+			truncated = true;
+			__stats.truncated = true;
+			break;
+		}
+
+		std::pop_heap(__bnbHeap.begin(), __bnbHeap.end(), order);
+		MSACBox box = __bnbHeap.back();
+		__bnbHeap.pop_back();
+		if(box.halfWidth < minHalfSize && box.halfHeight < minHalfSize)
+		{
+			smallUpper = max(smallUpper, box.upper);
+			continue;
+		}
+
+		for(int k=0; k<4; k++)
+		{
+			MSACBox child;
+			child.halfWidth = 0.5f*box.halfWidth;
+			child.halfHeight = 0.5f*box.halfHeight;
+			child.x = box.x + ((k & 1) ? child.halfWidth : -child.halfWidth);
+			child.y = box.y + ((k & 2) ? child.halfHeight : -child.halfHeight);
+			int lower = boundBox(child);
+			numNodes++;
+			if(lower > bestLower)
+			{
+				bestLower = lower;
+				bestX = child.x;
+				bestY = child.y;
+			}
+			if(child.upper > bestLower)
+			{
+				__bnbHeap.push_back(child);
+				std::push_heap(__bnbHeap.begin(), __bnbHeap.end(), order);
+			}
+		}
+	}
+
+	// The best center is scored like the random hypotheses
+	if(bestLower >= __minimal_sample_set_dimension)
+	{
+		float p[3] = {bestX, bestY, 1};
+		mul3(__Kinv, p, __vpBest);
+		normalize3(__vpBest);
+		int N_I = 0;
+		computeResiduals(__vpBest, 1, &__E[0]);
+		__J_best = GetCost(vpNum, __vpBest, &__E[0], &N_I);
+		__N_I_best = N_I;
+		*updated = true;
+	}
+
+	if(__verbose)
+	{
+		if(*optimal)
+			printf("Boxes = %d (optimal). ", numNodes);
+		else if(!truncated)
+			printf("Boxes = %d (not proved, the boxes of %.2f pixels may have %d inliers). ", numNodes, MSAC_BNB_MIN_SIZE, smallUpper);
+		else
+			printf("Boxes = %d. ", numNodes);
+		printf("Inliers = %6d/%6d (cost is J = %8.4f)\n", __N_I_best, __numLines, __J_best);
+		printf("Box Cal.VP = (%.3f,%.3f,%.3f)\n", __vpBest[0], __vpBest[1], __vpBest[2]);
+	}
+	return numNodes;
+}
+
+int MSAC::boundBox(MSACBox &box) const
+{
+	// The Nieto distance of a line segment is the sine of the angle between the line segment and the line from its
+	// mid point to the vanishing point. Seen from the mid point at the distance D of the center, the box is within
+	// the angle asin(r/D) of the center, r being its half diagonal
+	float r = sqrt(box.halfWidth*box.halfWidth + box.halfHeight*box.halfHeight);
+	float maxAngle = asin(min(sqrt(__T_noise_squared), 1.0f)) + 1e-5f;
+	float v[3] = {box.x, box.y, 1};
+	int lower = 0;
+	box.upper = 0;
+	for(int i=0; i<__numLines; i++)
+	{
+		float d = distanceNieto(v, __lx[i], __ly[i], __nNorm[i], __mx[i], __my[i]);
+		if(d*d <= __T_noise_squared)
+		{
+			lower++;
+			box.upper++;
+			continue;
+		}
+		float dx = box.x - __mx[i], dy = box.y - __my[i];
+		float D = sqrt(dx*dx + dy*dy);
+		if(D <= r || asin(min(d, 1.0f)) - asin(r/D) <= maxAngle)
+			box.upper++;
+	}
+	return lower;
+}
+
+float MSAC::GetCost(int vpNum, const float vp[3], const float *E, int *CS_counter) const
+{
+	// A degenerate MSS has no vanishing point, as in GetConsensusSet
+	if(vp[0] == 0 && vp[1] == 0 && vp[2] == 0)
+		return FLT_MAX;
 
-	// Estimate the vanishing point and the residual error
 	if(__mode == MODE_LS)
-		estimateLS(Li,Lengths, MSS, 2, vp);		
+		return errorLS(vpNum, E, NULL, CS_counter);
 	else if(__mode == MODE_NIETO)
-		estimateNIETO(Li, Mi, Lengths, MSS, 2, vp);
-	else
-		perror("ERROR: mode not supported. Please use {LS, LIEB, NIETO}\n");
+		return errorNIETO(vpNum, E, NULL, CS_counter);
+	return FLT_MAX;
+}
+
+void MSAC::GetBestConsensusSet(int vpNum)
+{
+	int N_I = 0;
+	computeResiduals(__vpBest, 1, &__E[0]);
+	GetConsensusSet(vpNum, __vpBest, &__E[0], &N_I);
+	__CS_best = __CS_idx;
 }
 
-float MSAC::GetConsensusSet(int vpNum, cv::Mat &Li, cv::Mat &Lengths, cv::Mat &Mi, cv::Mat &vp, std::vector<float> &E, int *CS_counter)
+float MSAC::GetConsensusSet(int vpNum, const float vp[3], const float *E, int *CS_counter)
 {
-	// Compute the error of each line segment of LSS with respect to v_est
-	// If it is less than the threshold, add to the CS	
+	// If the error of a line segment of LSS with respect to v_est is less than the threshold, add to the CS	
 	for(unsigned int i=0; i<__CS_idx.size(); i++)
 		__CS_idx[i] = -1;
+
+	// A degenerate MSS (e.g. twice the same line segment) has no vanishing point, it can not win
+	if(vp[0] == 0 && vp[1] == 0 && vp[2] == 0)
+		return FLT_MAX;
 	
 	float J = 0;
 
 	if(__mode == MODE_LS)
-		J = errorLS(vpNum, Li, vp, E, CS_counter);	
+		J = errorLS(vpNum, E, &__CS_idx[0], CS_counter);	
 	else if(__mode == MODE_NIETO)
-		J = errorNIETO(vpNum, Li, Lengths, Mi, vp, E, CS_counter);
+		J = errorNIETO(vpNum, E, &__CS_idx[0], CS_counter);
 	else
 		perror("ERROR: mode not supported, please use {LS, LIEB, NIETO}\n");
 
 	return J;
 }
+
+void MSAC::computeResiduals(const float *vps, int numHyp, float *E) const
+{
+	static const msacResidualsFunc residualsLS = selectResidualsLS();
+	static const msacResidualsFunc residualsNieto = selectResidualsNieto();
+
+	msacResidualData data;
+	data.numLines = __numLines;
+	if(__numLines == 0)
+		return;
+	data.lx = &__lx[0];
+	data.ly = &__ly[0];
+	data.lz = &__lz[0];
+	data.mx = &__mx[0];
+	data.my = &__my[0];
+	data.lNorm = &__lNorm[0];
+	data.nNorm = &__nNorm[0];
+
+	float v[3*MSAC_BATCH_SIZE];
+	double vNorm[MSAC_BATCH_SIZE];
+	prepareHypotheses(vps, numHyp, v, vNorm);
+
+	if(__mode == MODE_LS)
+		residualsLS(data, 0, v, vNorm, numHyp, E);
+	else if(__mode == MODE_NIETO)
+		residualsNieto(data, 0, v, vNorm, numHyp, E);
+	else
+		perror("ERROR: mode not supported, please use {LS, LIEB, NIETO}\n");
+}
+
+void MSAC::prepareHypotheses(const float *vps, int numHyp, float *v, double *vNorm) const
+{
+	for(int h=0; h<numHyp; h++)
+	{
+		const float *vp = vps + 3*h;
+		float *vn = v + 3*h;
+		vNorm[h] = sqrt((double)vp[0]*vp[0] + (double)vp[1]*vp[1] + (double)vp[2]*vp[2]);
+		for(int k=0; k<3; k++)
+			vn[k] = vp[k];
+
+		// In MODE_NIETO the vp arrives here calibrated, need to uncalibrate (check it anyway)
+		if(__mode == MODE_NIETO && fabs(vNorm[h] - 1) < 0.001)
+		{
+			mul3(__Kf, vp, vn);
+			if(vn[2] != 0)
+			{
+				vn[0] /= vn[2];
+				vn[1] /= vn[2];
+				vn[2] = 1;
+			}
+		}
+	}
+}
+
+// Bounded scoring ----------------------------------------------------------------------------------
+// The cost of a hypothesis is J = S/N_I, where each line segment adds a non-negative term to S, and 1 to N_I
+// if it is an inlier. After some line segments, the best the others can do is to be perfect inliers, so
+// J >= S_partial/(N_I_partial + remaining). Once this bound exceeds __J_best the hypothesis can not be
+// selected. The line segments are scored in a random order, so the first chunk is a random pre-test, the
+// residuals are scattered back to the original order. The bound is summed in another order than the cost,
+// the margin covers the float rounding, so the same hypotheses are selected as with the full scoring.
+void MSAC::initBoundedScoring()
+{
+	int N = __numLines;
+	__boundedOrder.resize(N);
+	for(int i=0; i<N; i++)
+		__boundedOrder[i] = i;
+	for(int i=N-1; i>0; i--)
+	{
+		// Fisher-Yates with a fixed generator, the order does not change the result
+		int j = (int)(((splitMix64((uint64)i) & 0xFFFFFFFF)*(uint64)(i + 1)) >> 32);
+		std::swap(__boundedOrder[i], __boundedOrder[j]);
+	}
+
+	__boundedData.resize(7*N);
+	const std::vector<float> *src[7] = {&__lx, &__ly, &__lz, &__mx, &__my, &__lNorm, &__nNorm};
+	for(int k=0; k<7; k++)
+		for(int i=0; i<N; i++)
+			__boundedData[k*N + i] = (*src[k])[__boundedOrder[i]];
+}
+
+void MSAC::scoreHypotheses(const float *vps, int numHyp, float *E, float *J, int *N_I, bool *complete) const
+{
+	for(int h=0; h<numHyp; h++)
+		complete[h] = true;
+	if(!__boundedScoring || __numLines == 0)
+	{
+		computeResiduals(vps, numHyp, E);
+		return;
+	}
+
+	static const msacResidualsFunc residualsLS = selectResidualsLS();
+	static const msacResidualsFunc residualsNieto = selectResidualsNieto();
+	msacResidualsFunc residuals = __mode == MODE_LS ? residualsLS : residualsNieto;
+
+	int N = __numLines;
+	float v[3*MSAC_BATCH_SIZE];
+	double vNorm[MSAC_BATCH_SIZE];
+	prepareHypotheses(vps, numHyp, v, vNorm);
+
+	// The degenerate hypotheses are left to GetConsensusSet
+	int alive[MSAC_BATCH_SIZE];
+	int numAlive = 0;
+	double S[MSAC_BATCH_SIZE];
+	int I[MSAC_BATCH_SIZE];
+	for(int h=0; h<numHyp; h++)
+	{
+		const float *vp = vps + 3*h;
+		if(vp[0] != 0 || vp[1] != 0 || vp[2] != 0)
+			alive[numAlive++] = h;
+		S[h] = 0;
+		I[h] = 0;
+	}
+
+	double maxBound = (double)__J_best*(1 + 1e-4);
+	float vAlive[3*MSAC_BATCH_SIZE];
+	double vNormAlive[MSAC_BATCH_SIZE];
+	float Echunk[MSAC_BATCH_SIZE*MSAC_BOUNDED_CHUNK];
+	for(int begin=0; begin<N && numAlive > 0; begin+=MSAC_BOUNDED_CHUNK)
+	{
+		int len = min(MSAC_BOUNDED_CHUNK, N - begin);
+		msacResidualData chunk;
+		chunk.numLines = len;
+		chunk.lx = &__boundedData[0*N + begin];
+		chunk.ly = &__boundedData[1*N + begin];
+		chunk.lz = &__boundedData[2*N + begin];
+		chunk.mx = &__boundedData[3*N + begin];
+		chunk.my = &__boundedData[4*N + begin];
+		chunk.lNorm = &__boundedData[5*N + begin];
+		chunk.nNorm = &__boundedData[6*N + begin];
+		for(int c=0; c<numAlive; c++)
+		{
+			for(int k=0; k<3; k++)
+				vAlive[3*c + k] = v[3*alive[c] + k];
+			vNormAlive[c] = vNorm[alive[c]];
+		}
+		residuals(chunk, 0, vAlive, vNormAlive, numAlive, Echunk);
+
+		int numStillAlive = 0;
+		for(int c=0; c<numAlive; c++)
+		{
+			int h = alive[c];
+			const float *e = &Echunk[c*len];
+			float *Eh = E + h*N;
+			for(int i=0; i<len; i++)
+			{
+				// The same terms as errorLS and errorNIETO
+				Eh[__boundedOrder[begin + i]] = e[i];
+				if(e[i] <= __T_noise_squared)
+				{
+					S[h] += e[i];
+					I[h]++;
+				}
+				else
+					S[h] += __T_noise_squared;
+				if(__mode == MODE_NIETO)
+					S[h] += e[i];
+			}
+
+			double bound = S[h]/(double)(I[h] + N - begin - len);
+			if(bound > maxBound)
+			{
+				complete[h] = false;
+				J[h] = (float)bound;
+				N_I[h] = I[h];
+			}
+			else
+				alive[numStillAlive++] = h;
+		}
+		numAlive = numStillAlive;
+	}
+}
 // Estimation functions
-void MSAC::estimateLS(cv::Mat &Li, cv::Mat &Lengths, std::vector<int> &set, int set_length, cv::Mat &vp)
+void MSAC::estimateMinimal(int i, int j, float vp[3]) const
+{
+	// Just the cross product
+	float li[3] = {__lx[i], __ly[i], __lz[i]};
+	float lj[3] = {__lx[j], __ly[j], __lz[j]};
+	float v[3];
+	cross3(li, lj, v);
+
+	if(__mode == MODE_LS)
+	{
+		// DATA IS CALIBRATED in MODE_LS
+		for(int k=0; k<3; k++)
+			vp[k] = v[k];
+	}
+	else if(__mode == MODE_NIETO)
+	{
+		// DATA IS NOT CALIBRATED for MODE_NIETO: calibrate
+		mul3(__Kinv, v, vp);
+	}
+	else
+		perror("ERROR: mode not supported. Please use {LS, LIEB, NIETO}\n");
+
+	normalize3(vp);
+}
+void MSAC::estimateLS(std::vector<int> &set, int set_length, float vp[3])
 {	
 	if (set_length == __minimal_sample_set_dimension)
 	{	
-		// Just the cross product
-		// DATA IS CALIBRATED in MODE_LS
-		cv::Mat ls0 = Mat(3,1,CV_32F);
-		cv::Mat ls1 = Mat(3,1,CV_32F);
-
-		ls0.at<float>(0,0) = Li.at<float>(set[0],0);
-		ls0.at<float>(1,0) = Li.at<float>(set[0],1);
-		ls0.at<float>(2,0) = Li.at<float>(set[0],2);
-
-		ls1.at<float>(0,0) = Li.at<float>(set[1],0);
-		ls1.at<float>(1,0) = Li.at<float>(set[1],1);
-		ls1.at<float>(2,0) = Li.at<float>(set[1],2);
-		
-		vp = ls0.cross(ls1);
-		
-		cv::normalize(vp, vp);
-		
+		estimateMinimal(set[0], set[1], vp);
 		return;
 	}	
 	else if (set_length<__minimal_sample_set_dimension)
@@ -433,27 +1474,23 @@ void MSAC::estimateLS(cv::Mat &Li, cv::Mat &Lengths, std::vector<int> &set, int
 		return;
 	}
 	
-	// Extract the line segments corresponding to the indexes contained in the set
-	cv::Mat li_set = Mat(3, set_length, CV_32F);
-	cv::Mat Lengths_set = Mat(set_length, set_length, CV_32F);
-	Lengths_set.setTo(0);
-		
-	// Fill line segments info
+	// Least squares solution
+	// The matrix ATA = L'*Tau'*Tau*L, with L the lines of the set and Tau = diag(lengths),
+	// is accumulated directly as the sum of length^2 * li*li'
+	double ata[9] = {0, 0, 0, 0, 0, 0, 0, 0, 0};
 	for (int i=0; i<set_length; i++)
 	{
-		li_set.at<float>(0,i) = Li.at<float>(set[i], 0);
-		li_set.at<float>(1,i) = Li.at<float>(set[i], 1);
-		li_set.at<float>(2,i) = Li.at<float>(set[i], 2);
-		
-		Lengths_set.at<float>(i,i) = Lengths.at<float>(set[i],set[i]);		
-	}		
-
-	// Least squares solution
-	// Generate the matrix ATA (a partir de LSS_set=A)
-	cv::Mat L = li_set.t();
-	cv::Mat Tau = Lengths_set;
+		int k = set[i];
+		double li[3] = {__lx[k], __ly[k], __lz[k]};
+		double w = (double)__lengths[k]*__lengths[k];
+		for (int r=0; r<3; r++)
+			for (int c=r; c<3; c++)
+				ata[r*3+c] += w*li[r]*li[c];
+	}
 	cv::Mat ATA = Mat(3,3,CV_32F);
-	ATA = L.t()*Tau.t()*Tau*L;
+	for (int r=0; r<3; r++)
+		for (int c=0; c<3; c++)
+			ATA.at<float>(r,c) = (float)(r <= c ? ata[r*3+c] : ata[c*3+r]);
 	
 	// Obtain eigendecomposition
 	cv::Mat w, v, vt;
@@ -469,36 +1506,19 @@ void MSAC::estimateLS(cv::Mat &Li, cv::Mat &Lengths, std::vector<int> &set, int
 	//std::cout << "vt" << vt << endl;
 
 	// Assign the result (the last column of v, corresponding to the eigenvector with lowest eigenvalue)
-	vp.at<float>(0,0) = v.at<float>(0,2);
-	vp.at<float>(1,0) = v.at<float>(1,2);
-	vp.at<float>(2,0) = v.at<float>(2,2);	
+	vp[0] = v.at<float>(0,2);
+	vp[1] = v.at<float>(1,2);
+	vp[2] = v.at<float>(2,2);	
 	
-	cv::normalize(vp,vp);
+	normalize3(vp);
 	
 	return;
 }
-void MSAC::estimateNIETO(cv::Mat &Li, cv::Mat &Lengths, cv::Mat &Mi, std::vector<int> &set, int set_length, cv::Mat &vp)
+void MSAC::estimateNIETO(std::vector<int> &set, int set_length, float vp[3])
 {
 	if (set_length == __minimal_sample_set_dimension)
 	{	
-		// Just the cross product
-		// DATA IS NOT CALIBRATED for MODE_NIETO
-		cv::Mat ls0 = Mat(3,1,CV_32F);
-		cv::Mat ls1 = Mat(3,1,CV_32F);
-
-		ls0.at<float>(0,0) = Li.at<float>(set[0],0);
-		ls0.at<float>(1,0) = Li.at<float>(set[0],1);
-		ls0.at<float>(2,0) = Li.at<float>(set[0],2);
-
-		ls1.at<float>(0,0) = Li.at<float>(set[1],0);
-		ls1.at<float>(1,0) = Li.at<float>(set[1],1);
-		ls1.at<float>(2,0) = Li.at<float>(set[1],2);
-		
-		vp = ls0.cross(ls1);
-
-		// Calibrate (and normalize) vp
-		vp = __K.inv()*vp;
-		cv::normalize(vp, vp);
+		estimateMinimal(set[0], set[1], vp);
 		return;
 	}
 	else if (set_length<__minimal_sample_set_dimension)
@@ -507,25 +1527,8 @@ void MSAC::estimateNIETO(cv::Mat &Li, cv::Mat &Lengths, cv::Mat &Mi, std::vector
 		return;
 	}
 
-	// Extract the line segments corresponding to the indexes contained in the set
-	cv::Mat li_set = Mat(3, set_length, CV_32F);
-	cv::Mat Lengths_set = Mat(set_length, set_length, CV_32F);
-	cv::Mat mi_set = Mat(3, set_length, CV_32F);
-	Lengths_set.setTo(0);
-
-	// Fill line segments info
-	for (int i=0; i<set_length; i++)
-	{
-		li_set.at<float>(0,i) = Li.at<float>(set[i], 0);
-		li_set.at<float>(1,i) = Li.at<float>(set[i], 1);
-		li_set.at<float>(2,i) = Li.at<float>(set[i], 2);
-		
-		Lengths_set.at<float>(i,i) = Lengths.at<float>(set[i],set[i]);		
-
-		mi_set.at<float>(0,i) = Mi.at<float>(set[i], 0);
-		mi_set.at<float>(1,i) = Mi.at<float>(set[i], 1);
-		mi_set.at<float>(2,i) = Mi.at<float>(set[i], 2);
-	}	
+	// The line segments of the set are passed by their indexes, no copy is made
+	data_struct data(&__lx[0], &__ly[0], &__nNorm[0], &__mx[0], &__my[0], &__lengths[0], &set[0], set_length, __Kf);
 
 #ifdef DEBUG_MAP
 	double dtheta = 0.01;
@@ -536,7 +1539,7 @@ void MSAC::estimateNIETO(cv::Mat &Li, cv::Mat &Lengths, cv::Mat &Mi, std::vector
 	cv::Mat debugMap(numTheta, numPhi, CV_32F);
 	debugMap.setTo(0);
 
-	data_struct dataTest(li_set, Lengths_set, mi_set, __K);
+	data_struct &dataTest = data;
 	double *fvecTest = new double[set_length];
 	int *infoTest;
 	int aux = 0;
@@ -602,42 +1605,47 @@ void MSAC::estimateNIETO(cv::Mat &Li, cv::Mat &Lengths, cv::Mat &Mi, std::vector
 	// The starting point is the provided vp which is already calibrated
 	if(__verbose)
 	{
-		printf("\nInitial Cal.VP = (%.3f,%.3f,%.3f)\n", vp.at<float>(0,0), vp.at<float>(1,0), vp.at<float>(2,0));		
-		cv::Mat vpUnc = Mat(3,1,CV_32F);
-		vpUnc = __K*vp;
-		if(vpUnc.at<float>(2,0) != 0)
+		printf("\nInitial Cal.VP = (%.3f,%.3f,%.3f)\n", vp[0], vp[1], vp[2]);		
+		float vpUnc[3];
+		mul3Accurate(__Kf, vp, vpUnc);
+		if(vpUnc[2] != 0)
 		{
-			vpUnc.at<float>(0,0) /= vpUnc.at<float>(2,0);
-			vpUnc.at<float>(1,0) /= vpUnc.at<float>(2,0);
-			vpUnc.at<float>(2,0) = 1;
+			vpUnc[0] /= vpUnc[2];
+			vpUnc[1] /= vpUnc[2];
+			vpUnc[2] = 1;
 		}
-		printf("Initial VP = (%.3f,%.3f,%.3f)\n", vpUnc.at<float>(0,0), vpUnc.at<float>(1,0), vpUnc.at<float>(2,0));		
+		printf("Initial VP = (%.3f,%.3f,%.3f)\n", vpUnc[0], vpUnc[1], vpUnc[2]);		
 	}
 
 	// Convert to spherical coordinates to move on the sphere surface (restricted to r=1)
-	double x = (double)vp.at<float>(0,0);
-	double y = (double)vp.at<float>(1,0);
-	double z = (double)vp.at<float>(2,0);
-	double r = cv::norm(vp);
+	double x = (double)vp[0];
+	double y = (double)vp[1];
+	double z = (double)vp[2];
+	double r = sqrt(x*x + y*y + z*z);
 	double theta = acos(z/r);
 	double phi = atan2(y,x);	
 
 	if(__verbose)
 		printf("Initial Cal.VP (Spherical) = (%.3f,%.3f,%.3f)\n", theta, phi, r);		
 
-	//double par[] = {(double)vp.at<float>(0,0), (double)vp.at<float>(1,0), (double)vp.at<float>(2,0)};
+	//double par[] = {(double)vp[0], (double)vp[1], (double)vp[2]};
 	double par[] = {theta, phi};
 
+	// The Jacobian is computed in closed form, so control.epsilon (the step of the forward differences) is not used
 	lm_control_struct control = lm_control_double;
-	control.epsilon = 1e-5;	// less than 1?
 	if(__verbose)
 		control.printflags = 2; //monitor status (+1) and parameters (+2), (4): residues at end of fit, (8): residuals at each step
 	else
 		control.printflags = 0;
 	lm_status_struct status;
-	data_struct data(li_set, Lengths_set, mi_set, __K);
 
-	lmmin(num_par, par, m_dat, &data, evaluateNieto, &control, &status, lm_printout_std);
+	// The memory is sized for all the line segments, so it is only reallocated when a frame has more of them
+	size_t lmSize = (lm_workspace_size(num_par, m_dat) + sizeof(double) - 1)/sizeof(double);
+	if(__lmMemory.size() < lmSize)
+		__lmMemory.resize((lm_workspace_size(num_par, max(m_dat, __numLines)) + sizeof(double) - 1)/sizeof(double));
+	lm_workspace workspace;
+	lm_workspace_init(&workspace, num_par, m_dat, &__lmMemory[0]);
+	lmmin_ws(num_par, par, m_dat, &data, evaluateNieto, jacobianNieto, &control, &status, lm_printout_std, &workspace);
 
 	if(__verbose)
 		printf("Converged Cal.VP (Spherical) = (%.3f,%.3f,%.3f)\n", par[0], par[1], r);		
@@ -650,39 +1658,22 @@ void MSAC::estimateNIETO(cv::Mat &Li, cv::Mat &Lengths, cv::Mat &Mi, std::vector
 	y = r*sin(phi)*sin(theta);
 	z = r*cos(theta);
 
-	vp.at<float>(0,0) = (float)x;
-	vp.at<float>(1,0) = (float)y;
-	vp.at<float>(2,0) = (float)z;
+	vp[0] = (float)x;
+	vp[1] = (float)y;
+	vp[2] = (float)z;
 
 }
 // Error functions
-float MSAC::errorLS(int vpNum, cv::Mat &Li, cv::Mat &vp, std::vector<float> &E, int *CS_counter)
+float MSAC::errorLS(int vpNum, const float *E, int *CS, int *CS_counter) const
 {
-	cv::Mat vn = vp;
-	double vn_norm = cv::norm(vn);
-
-	cv::Mat li;
-	li = Mat(3,1,CV_32F);
-	double li_norm = 0;
-	float di = 0;
-	
 	float J = 0;
-	for(int i=0; i<Li.rows; i++)
+	for(int i=0; i<__numLines; i++)
 	{
-		li.at<float>(0,0) = Li.at<float>(i,0);
-		li.at<float>(1,0) = Li.at<float>(i,1);
-		li.at<float>(2,0) = Li.at<float>(i,2);
-
-		li_norm = cv::norm(li); // esto lo podria precalcular antes
-		di = (float)vn.dot(li);		
-		di /= (float)(vn_norm*li_norm);
-
-		E[i] = di*di;
-		
 		/* Add to CS if error is less than expected noise */
 		if (E[i] <= __T_noise_squared)
 		{
-			__CS_idx[i] = vpNum;		// set index to 1
+			if(CS)
+				CS[i] = vpNum;		// set index to 1
 			(*CS_counter)++;
 			
 			// Torr method
@@ -698,50 +1689,16 @@ float MSAC::errorLS(int vpNum, cv::Mat &Li, cv::Mat &vp, std::vector<float> &E,
 	
 	return J;
 }
-float MSAC::errorNIETO(int vpNum, cv::Mat &Li, cv::Mat &Lengths, cv::Mat &Mi, cv::Mat &vp, std::vector<float> &E, int *CS_counter)
+float MSAC::errorNIETO(int vpNum, const float *E, int *CS, int *CS_counter) const
 {
 	float J = 0;
-	float di = 0;
-	
-	cv::Mat lineSegment = Mat(3,1,CV_32F);
-	float lengthLineSegment = 0;
-	cv::Mat midPoint = Mat(3,1,CV_32F);
-
-	// The vp arrives here calibrated, need to uncalibrate (check it anyway)
-	cv::Mat vn = cv::Mat(3,1,CV_32F);
-	double vpNorm = cv::norm(vp);
-	if(fabs(vpNorm - 1) < 0.001)
-	{
-		// Calibrated -> uncalibrate
-		vn = __K*vp;
-		if(vn.at<float>(2,0) != 0)
-		{
-			vn.at<float>(0,0) /= vn.at<float>(2,0);
-			vn.at<float>(1,0) /= vn.at<float>(2,0);
-			vn.at<float>(2,0) = 1;
-		}
-	}
-	
-	for(int i=0; i<Li.rows; i++)
+	for(int i=0; i<__numLines; i++)
 	{ 		
-		lineSegment.at<float>(0,0) = Li.at<float>(i,0);
-		lineSegment.at<float>(1,0) = Li.at<float>(i,1);
-		lineSegment.at<float>(2,0) = Li.at<float>(i,1);
-		
-		lengthLineSegment = Lengths.at<float>(i,i);
-
-		midPoint.at<float>(0,0) = Mi.at<float>(i,0);
-		midPoint.at<float>(1,0) = Mi.at<float>(i,1);
-		midPoint.at<float>(2,0) = Mi.at<float>(i,2);
-		
-		di = distanceNieto(vn, lineSegment, lengthLineSegment, midPoint);
-
-		E[i] = di*di;
-
 		/* Add to CS if error is less than expected noise */
 		if (E[i] <= __T_noise_squared)
 		{
-			__CS_idx[i] = vpNum;		// set index to 1
+			if(CS)
+				CS[i] = vpNum;		// set index to 1
 			(*CS_counter)++;
 			
 			// Torr method
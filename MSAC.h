@@ -11,9 +11,54 @@
 
 #define MODE_LS		0
 #define MODE_NIETO	1
+#define MODE_ACCUMULATOR	2	// Voting on an image-plane grid instead of random hypotheses, with the cost and reestimation of MODE_NIETO
+#define MODE_BRANCH_AND_BOUND	3	// Globally optimal number of inliers in the region of the accumulator, with the cost and reestimation of MODE_NIETO
+
+#define MSAC_ACCUMULATOR_CELL	8	// Size of the cells of the accumulator in pixels
+#define MSAC_ACCUMULATOR_MARGIN	0.5	// The accumulator covers the image and this fraction of its size on each side
+
+#define MSAC_BNB_MAX_NODES	20000	// Default maximum number of boxes bounded by the branch and bound
+#define MSAC_BNB_MIN_SIZE	0.5	// The boxes smaller than this in pixels are not split
+
+#define MSAC_DEFAULT_SEED	0xffffffff	// Default state of cv::RNG
+
+#define SAMPLER_UNIFORM	0
+#define SAMPLER_PROSAC	1
+
+#define MSAC_PROSAC_BETA	0.05	// Probability that a line segment is an inlier of a wrong vanishing point
+#define MSAC_PROSAC_PSI		0.05	// Maximum probability that the best consensus set is found by chance
+
+#define MSAC_BATCH_SIZE	4	// Number of hypotheses scored in one pass over the line segments
+#define MSAC_PARALLEL_BATCH_SIZE	(8*MSAC_BATCH_SIZE)	// Number of hypotheses scored by the threads between two updates of T_iter
+#define MSAC_BOUNDED_CHUNK	32	// Number of line segments scored between two checks of the bounded scoring
+#define MSAC_WARM_START_HYPOTHESES	MSAC_BATCH_SIZE	// Number of hypotheses of the previous call scored first
+#define MSAC_WARM_START_ITERATIONS	8	// Number of random hypotheses after them, if they still explain the line segments
+#define MSAC_WARM_START_RATIO		0.9	// They do if they keep this fraction of the previous inlier ratio
+
+class MSACHypothesesBody;
+
+/** Statistics of the last call of MSAC::multipleVPEstimation*/
+struct MSACStats
+{
+	int iterations;		// Number of hypotheses scored, over all the vanishing points
+	double elapsedMs;	// Elapsed time in milliseconds
+	bool truncated;		// The budget stopped the search, the best hypotheses so far were returned
+	bool optimal;		// The branch and bound proved that no vanishing point of its region has more inliers. It is false
+				// if the search was truncated, or if a box of MSAC_BNB_MIN_SIZE could still hold more inliers
+};
+
+/** Box of vanishing points of the branch and bound, in pixels*/
+struct MSACBox
+{
+	float x, y;			// Center
+	float halfWidth, halfHeight;
+	int upper;			// Upper bound of the number of inliers of the vanishing points of the box
+};
 
 class MSAC
 {
+	friend class MSACHypothesesBody;
+
 public:
 	MSAC(void);
 	~MSAC(void);
@@ -21,6 +66,9 @@ public:
 private:
 	// Error Mode
 	int __mode;	// Error mode (MODE_LS or MODE_NIETO)
+	bool __accumulator;	// The hypotheses are the peaks of the accumulator (MODE_ACCUMULATOR)
+	bool __branchAndBound;	// The vanishing point is found by branch and bound (MODE_BRANCH_AND_BOUND)
+	int __sampler;	// Sampler of the MSS (SAMPLER_UNIFORM or SAMPLER_PROSAC)
 
 	// Image info
 	int __width;
@@ -36,6 +84,16 @@ private:
 	bool __verbose;
 	bool __update_T_iter;
 	bool __notify;
+	bool __parallel;			// Score the hypotheses in parallel batches
+	uint64 __seed;				// Seed of the random hypotheses
+	cv::RNG __rng;				// Generator of the random hypotheses, the parallel mode uses a counter-based one
+	int __exhaustiveMaxLines;		// All the pairs are scored up to this number of line segments (0: never)
+	int __exhaustiveTopLines;		// Only the pairs of the longest line segments are scored (0: all)
+	bool __boundedScoring;			// Stop scoring a hypothesis when it can not beat the best one
+	bool __warmStart;			// Start from the hypotheses of the previous call
+	int __budgetIterations;			// Maximum number of hypotheses per vanishing point (0: no limit)
+	int64 __budgetTicks;			// Maximum duration of multipleVPEstimation in ticks (0: no limit)
+	MSACStats __stats;
 
 	// Parameters (precalculated)
 	int __minimal_sample_set_dimension;	// Dimension of the MSS (minimal sample set)
@@ -44,57 +102,232 @@ private:
 	std::vector<int> __MSS;			// Minimal sample set
 
 	// Auxiliar variables
-	cv::Mat __a, __an, __b, __bn, __li, __c;	
-	cv::Mat __vp, __vpAux;
+	std::vector<cv::Mat> __vpOutputs;	// Output vanishing point of each vpNum, pushed into vps and overwritten by the next call
+	std::vector<int> __indCS;		// Indexes of the Consensus Set of the current vanishing point
+	float __vpBatch[3*MSAC_BATCH_SIZE];	// Hypotheses of the current batch (calibrated)
+	float __batchJ[MSAC_BATCH_SIZE];	// Lower bounds of the costs of the hypotheses of the batch that were not fully scored
+	int __batchN_I[MSAC_BATCH_SIZE];	// Their number of inliers so far
+	bool __batchComplete[MSAC_BATCH_SIZE];	// The residuals of the hypothesis are complete
+	float __vpBest[3];			// Best hypothesis (calibrated)
 
 	// Calibration
 	cv::Mat __K;				// Approximated Camera calibration matrix
+	float __Kf[9];				// __K as plain floats (row-major)
+	float __Kinv[9];			// Inverse of __K (row-major)
 
-	// Data (Line Segments)	
-	cv::Mat __Li;				// Matrix of appended line segments (3xN) for N line segments
-	cv::Mat __Mi;				// Matrix of middle points (3xN)
-	cv::Mat __Lengths;			// Matrix of lengths (1xN)
+	// Data (Line Segments), stored as structure of arrays with one entry per line segment
+	int __numLines;
+	std::vector<float> __lx, __ly, __lz;	// General form of the line segments li=[lx;ly;lz] (calibrated in MODE_LS)
+	std::vector<float> __mx, __my;		// Middle points [mx;my;1]
+	std::vector<float> __lengths;		// Lengths, normalized by their sum
+	std::vector<double> __rawLengths;	// Lengths in pixels
+	std::vector<int> __lineIndex;		// Index of the line segment in the input, the inliers of the previous vanishing points are removed
+	std::vector<float> __lNorm;		// Norm of li (MODE_LS)
+	std::vector<float> __nNorm;		// Norm of the 2D normal [-ly;lx] (MODE_NIETO)
 
 	// Consensus set
 	std::vector<int> __CS_idx, __CS_best;	// Indexes of line segments: 1 -> belong to CS, 0 -> does not belong 
 	std::vector<int> __ind_CS_best;		// Vector of indexes of the Consensus Set 
+	std::vector<float> __E;			// Residuals of the line segments for the hypotheses of the batch (MSAC_BATCH_SIZE x N)
 	double vp_length_ratio;			
 
+	// Parallel mode, one entry per hypothesis of the batch
+	std::vector<float> __vpParallel;	// Hypotheses (calibrated)
+	std::vector<float> __J_parallel;	// Costs
+	std::vector<int> __N_I_parallel;	// Number of inliers
+	std::vector<float> __E_parallel;	// Residuals (MSAC_PARALLEL_BATCH_SIZE x N)
+
+	// PROSAC sampler, indexed by the size n of the sampled subset
+	std::vector<int> __prosacOrder;		// Line segments, longest first
+	std::vector<int> __prosacGrowth;	// Number of the sample at which the n-th line segment enters (T'_n)
+	std::vector<int> __prosacIMin;		// Minimum number of inliers among the first n for a non-random consensus set
+
+	// Bounded scoring: the line segments in a random order, as structure of arrays
+	std::vector<int> __boundedOrder;
+	std::vector<float> __boundedData;	// lx, ly, lz, mx, my, lNorm, nNorm, N values each
+
+	// Warm start, indexed by the vanishing point
+	std::vector<std::vector<float> > __warmHypotheses;	// The final vanishing point and the last best hypotheses of the previous call (calibrated)
+	std::vector<float> __warmInlierRatio;			// Their inlier ratio
+	std::vector<float> __acceptedHypotheses;		// The last best hypotheses of the current call
+
+	// Accumulator mode: grid of __accCols x __accRows cells whose first corner is (__accX0, __accY0) in the image
+	int __accCols, __accRows;
+	float __accX0, __accY0;
+	std::vector<float> __accVotes;		// Sum of the normalized lengths of the line segments whose line crosses the cell
+	std::vector<float> __accSums;		// Votes of the 3x3 cells around each cell
+
+	// Branch and bound mode
+	std::vector<MSACBox> __bnbHeap;		// Boxes to split, the highest upper bound first
+
+	// Exhaustive mode
+	std::vector<int> __pairLines;		// Line segments whose pairs are scored, longest first
+
+	// Memory of the work space of the Lev.-Marq. reestimation, grown to the largest number of line segments seen so far
+	std::vector<double> __lmMemory;
+
+	// Clusters of the line segments of the vector<vector<Point> > interface
+	std::vector<int> __clusterIndices;
+	std::vector<int> __clusterOffsets;
+
 public:
 	
-	/** Initialisation of MSAC procedure*/
-	void init(int mode, cv::Size imSize, bool verbose=false);
+	/** Initialisation of MSAC procedure, the random hypotheses restart from seed. MODE_ACCUMULATOR replaces the random
+		hypotheses by the peaks of a vote of the line segments on a grid around the image: its cost is linear in the
+		number of line segments and it has no random iterations, the vanishing points must be near the image.
+		MODE_BRANCH_AND_BOUND searches the same region for the vanishing point with the most inliers, and reports in
+		getStats() whether it is proved optimal. The budget of setBudget bounds its number of boxes (MSAC_BNB_MAX_NODES
+		by default) and its time. Each instance has its own
+		generator, so the instances can run in different threads*/
+	void init(int mode, cv::Size imSize, bool verbose=false, uint64 seed=MSAC_DEFAULT_SEED);
+
+	/** Enables the parallel mode: the hypotheses are drawn from a counter-based generator and scored in batches
+		by the threads of cv::parallel_for_, the batch is then merged in order. For a fixed seed the result does
+		not depend on the number of threads. Disabled by default, it is kept by init*/
+	void setParallel(bool enable);
+
+	/** Enables the exhaustive mode: up to maxLines line segments, the hypotheses of all the pairs of line segments
+		are scored instead of random samples, so the best consensus set is found deterministically. If topLines
+		is not 0, only the pairs of the topLines longest line segments are scored. Above maxLines the random
+		sampling is used. Disabled by default (maxLines=0), it is kept by init*/
+	void setExhaustive(int maxLines, int topLines=0);
+
+	/** Sets the sampler of the MSS: SAMPLER_UNIFORM (default) draws two line segments at random, SAMPLER_PROSAC
+		draws them progressively from the longest ones and stops with the PROSAC criterion. It is kept by init*/
+	void setSampler(int sampler);
+
+	/** Enables the bounded scoring: the residuals of a hypothesis are computed in chunks of line segments, in a
+		random order, and the scoring stops as soon as the cost can no longer beat the best one. The first chunk
+		is a pre-test on a random subset. The selected hypotheses are the same as with the full scoring.
+		Disabled by default, it is kept by init*/
+	void setBoundedScoring(bool enable);
+
+	/** Enables the warm start for video: the final vanishing point and the last best hypotheses of the previous
+		call are scored first. If they keep most of the previous inlier ratio, only a few random hypotheses are
+		scored after them, otherwise the sampling runs as usual. Disabled by default, init forgets the previous
+		hypotheses*/
+	void setWarmStart(bool enable);
+
+	/** Bounds the search of multipleVPEstimation: at most maxIterations hypotheses per vanishing point and
+		maxMilliseconds for the whole call, checked between two batches of hypotheses. When the budget is
+		reached, the best hypothesis so far is reestimated and returned, and getStats() reports it as truncated.
+		The vanishing points that are not started within the time are not returned. At least one batch is
+		scored for the first vanishing point. 0 means no limit (default), it is kept by init*/
+	void setBudget(int maxIterations, double maxMilliseconds=0);
+
+	/** Returns the number of iterations, the elapsed time and the truncation flag of the last call of
+		multipleVPEstimation*/
+	const MSACStats &getStats() const;
 
 	/** Main function which returns, if detected, several vanishing points and a vector of containers of line segments
 		corresponding to each Consensus Set.*/
-	void multipleVPEstimation(std::vector<std::vector<cv::Point> > &lineSegments, std::vector<std::vector<std::vector<cv::Point> > > &lineSegmentsClusters, std::vector<int> &numInliers, std::vector<cv::Mat> &vps, int numVps);
+	void multipleVPEstimation(const std::vector<std::vector<cv::Point> > &lineSegments, std::vector<std::vector<std::vector<cv::Point> > > &lineSegmentsClusters, std::vector<int> &numInliers, std::vector<cv::Mat> &vps, int numVps);
+
+	/** Same as above for the line segments (x1, y1, x2, y2), without copying them: the Consensus Set of the vanishing
+		point c is clusterIndices[clusterOffsets[c]], ..., clusterIndices[clusterOffsets[c+1]-1], the indexes of its
+		line segments in lines in increasing order. clusterIndices and clusterOffsets are overwritten, numInliers and
+		vps are appended like above. Both functions reuse the matrices of vps in the next call, they must be cloned
+		to be kept*/
+	void multipleVPEstimation(const std::vector<cv::Vec4i> &lines, std::vector<int> &clusterIndices, std::vector<int> &clusterOffsets, std::vector<int> &numInliers, std::vector<cv::Mat> &vps, int numVps);
 		
 	/** Draws vanishing points and line segments according to the vanishing point they belong to*/
 	void drawCS(cv::Mat &im, std::vector<std::vector<std::vector<cv::Point> > > &lineSegmentsClusters, std::vector<cv::Mat> &vps);
 
 private:	
-	/** This function returns a randomly selected MSS*/
-	void GetMinimalSampleSet(cv::Mat &Li, cv::Mat &Lengths, cv::Mat &Mi, std::vector<int> &MSS, cv::Mat &vp);
+	/** This function returns a randomly selected MSS for the hypothesis hypNum*/
+	void GetMinimalSampleSet(int hypNum, std::vector<int> &MSS, float vp[3]);
+
+	/** This function returns the MSS of the hypothesis hypNum of the vanishing point vpNum in parallel mode,
+		it only depends on the seed, vpNum and hypNum*/
+	void GetMinimalSampleSetCounter(int vpNum, int hypNum, float vp[3]) const;
+
+	/** This function fills the PROSAC containers for the current line segments*/
+	void initProsac();
+
+	/** This function returns the size of the subset of the longest line segments sampled by PROSAC for the
+		hypothesis hypNum, INT_MAX if all the line segments are sampled uniformly*/
+	int prosacSubsetSize(int hypNum) const;
+
+	/** This function returns the number of iterations after which PROSAC stops for the best consensus set*/
+	int prosacIterations(int vpNum) const;
+
+	/** This function scores the hypotheses firstHyp, ..., firstHyp+MSAC_PARALLEL_BATCH_SIZE-1 in parallel*/
+	void scoreBatchParallel(int vpNum, int firstHyp);
+
+	/** This function scores the groups [groupBegin, groupEnd) of MSAC_BATCH_SIZE hypotheses of the parallel batch*/
+	void scoreGroupsParallel(int vpNum, int firstHyp, int groupBegin, int groupEnd);
+
+	/** This function scores the hypotheses of all the pairs of line segments, returns the number of pairs*/
+	int searchAllPairs(int vpNum, bool *updated);
+
+	/** This function scores the hypotheses of the MSAC_BATCH_SIZE highest peaks of the accumulator, returns their number*/
+	int voteAccumulator(int vpNum, bool *updated);
 
-	/** This function returns the Consensus Set for a given vanishing point and set of line segments*/
-	float GetConsensusSet(int vpNum, cv::Mat &Li, cv::Mat &Lengths, cv::Mat &Mi, cv::Mat &vEst, std::vector<float> &E, int *CS_counter);
+	/** This function finds the vanishing point with the most inliers by branch and bound, returns the number of boxes.
+		optimal is false if the budget stopped the search*/
+	int branchAndBound(int vpNum, int64 startTicks, bool *updated, bool *optimal);
+
+	/** This function returns the number of inliers of the center of the box and sets its upper bound*/
+	int boundBox(MSACBox &box) const;
+
+	/** This function returns the Consensus Set for a given vanishing point and the residuals of the line segments*/
+	float GetConsensusSet(int vpNum, const float vp[3], const float *E, int *CS_counter);
+
+	/** This function returns the cost of a vanishing point like GetConsensusSet, without filling the CS*/
+	float GetCost(int vpNum, const float vp[3], const float *E, int *CS_counter) const;
+
+	/** This function finds __CS_best of __vpBest*/
+	void GetBestConsensusSet(int vpNum);
+
+	/** This function computes the residuals of numHyp vanishing points to all the line segments in a single pass
+		over the data: E[h*N + i] is the residual of the line segment i for the vanishing point h*/
+	void computeResiduals(const float *vps, int numHyp, float *E) const;
+
+	/** This function returns the vanishing points as used by the residuals, and their norms*/
+	void prepareHypotheses(const float *vps, int numHyp, float *v, double *vNorm) const;
+
+	/** This function computes the residuals of numHyp vanishing points like computeResiduals. With the bounded
+		scoring, the hypotheses that can not beat __J_best are stopped early: complete[h] is false, J[h] is a lower
+		bound of their cost (higher than __J_best) and N_I[h] their number of inliers so far*/
+	void scoreHypotheses(const float *vps, int numHyp, float *E, float *J, int *N_I, bool *complete) const;
+
+	/** This function fills the random order of the bounded scoring for the current line segments*/
+	void initBoundedScoring();
 
 	/** This is an auxiliar function that formats data into appropriate containers*/
-	void fillDataContainers(std::vector<std::vector<cv::Point> > &lineSegments);
+	void fillDataContainers(const std::vector<std::vector<cv::Point> > &lineSegments);
+	void fillDataContainers(const std::vector<cv::Vec4i> &lines);
+
+	/** This function fills the data of the line segment i from its end-points*/
+	void setLineSegment(int i, float x1, float y1, float x2, float y2);
+
+	/** This function normalizes the lengths of the remaining line segments by their sum*/
+	void normalizeLengths();
+
+	/** This function removes the Consensus Set of the vanishing point vpNum from the data, in place*/
+	void removeConsensusSet(int vpNum);
+
+	/** This function estimates the vanishing points of the line segments of the data containers*/
+	void estimateVPs(std::vector<int> &clusterIndices, std::vector<int> &clusterOffsets, std::vector<int> &numInliers, std::vector<cv::Mat> &vps, int numVps);
 	
 	// Estimation functions
+	/** This function estimates the (calibrated) vanishing point of two line segments*/
+	void estimateMinimal(int i, int j, float vp[3]) const;
+
 	/** This function estimates the vanishing point for a given set of line segments using the Least-squares procedure*/
-	void estimateLS(cv::Mat &Li, cv::Mat &Lengths, std::vector<int> &set, int set_length, cv::Mat &vEst);
+	void estimateLS(std::vector<int> &set, int set_length, float vEst[3]);
 
 	/** This function estimates the vanishing point for a given set of line segments using the Nieto's method*/
-	void estimateNIETO(cv::Mat &Li, cv::Mat &Lengths, cv::Mat &Mi, std::vector<int> &set, int set_length, cv::Mat &vEst);
+	void estimateNIETO(std::vector<int> &set, int set_length, float vEst[3]);
 	
 	// Error functions
-	/** This function computes the residuals of the line segments given a vanishing point using the Least-squares method*/
-	float errorLS(int vpNum, cv::Mat &Li, cv::Mat &vp, std::vector<float> &E, int *CS_counter);
+	/** This function computes the cost of the residuals of the line segments using the Least-squares method,
+		the inliers are labelled with vpNum in CS unless it is NULL*/
+	float errorLS(int vpNum, const float *E, int *CS, int *CS_counter) const;
 
-	/** This function computes the residuals of the line segments given a vanishing point using the Nieto's method*/
-	float errorNIETO(int vpNum, cv::Mat &Li, cv::Mat &lengthsLS, cv::Mat &Mi, cv::Mat &vp, std::vector<float> &E, int *CS_counter);
+	/** This function computes the cost of the residuals of the line segments using the Nieto's method,
+		the inliers are labelled with vpNum in CS unless it is NULL*/
+	float errorNIETO(int vpNum, const float *E, int *CS, int *CS_counter) const;
 	
 };
 
@@ -55,41 +55,104 @@ void evaluateNieto( const double *param, int m_dat, const void *data,
 	double z = cos(theta);
 
 	// 2) Uncalibrate it using the K matrix in the data	
-	cv::Mat vn = Mat(3,1,CV_32F);
-	vn.at<float>(0,0) = (float)x;
-	vn.at<float>(1,0) = (float)y;
-	vn.at<float>(2,0) = (float)z;
-	
-	cv::Mat vanishingPoint = mydata->K*vn;
-	if(vanishingPoint.at<float>(2,0) != 0)
+	const float *K = mydata->K;
+	float vanishingPoint[3];
+	vanishingPoint[0] = (float)(K[0]*x + K[1]*y + K[2]*z);
+	vanishingPoint[1] = (float)(K[3]*x + K[4]*y + K[5]*z);
+	vanishingPoint[2] = (float)(K[6]*x + K[7]*y + K[8]*z);
+	if(vanishingPoint[2] != 0)
 	{
-		vanishingPoint.at<float>(0,0) /= vanishingPoint.at<float>(2,0);
-		vanishingPoint.at<float>(1,0) /= vanishingPoint.at<float>(2,0);
-		vanishingPoint.at<float>(2,0) = 1;
+		vanishingPoint[0] /= vanishingPoint[2];
+		vanishingPoint[1] /= vanishingPoint[2];
+		vanishingPoint[2] = 1;
 	}
 
-	cv::Mat lineSegment = Mat(3,1,CV_32F);
-	float lengthLineSegment = 0;
-	cv::Mat midPoint = Mat(3,1,CV_32F);
-
 	// Fill fvec
-	for(int p=0; p< mydata->LSS.cols ; p++)
+	for(int p=0; p< mydata->setLength ; p++)
 	{
-		// Compute error for this vanishing point (contained in param), and this line segment (LSS.at<double>(0,p);LSS.at<double>(1,p);LSS.at<double>(2,p)) and midPoint
-		lineSegment.at<float>(0,0) = mydata->LSS.at<float>(0,p);
-		lineSegment.at<float>(1,0) = mydata->LSS.at<float>(1,p);
-		lineSegment.at<float>(2,0) = mydata->LSS.at<float>(2,p);
-
-		lengthLineSegment = mydata->Lengths.at<float>(p,p);
-
-		midPoint.at<float>(0,0) = mydata->midPoints.at<float>(0,p);
-		midPoint.at<float>(1,0) = mydata->midPoints.at<float>(1,p);
-		midPoint.at<float>(2,0) = mydata->midPoints.at<float>(2,p);
-		
-		fvec[p] = distanceNieto(vanishingPoint, lineSegment, lengthLineSegment, midPoint);
+		// Compute error for this vanishing point (contained in param), and this line segment and midPoint
+		int i = mydata->set[p];
+		fvec[p] = distanceNieto(vanishingPoint, mydata->lx[i], mydata->ly[i], mydata->nNorm[i], mydata->mx[i], mydata->my[i]);
 	}
 
 	/* to prevent a 'unused variable' warning */
 	*info = *info;
 
-}
\ No newline at end of file
+}
+void jacobianNieto( const double *param, int m_dat, const void *data,
+					double *fjac, int *info)
+{
+	data_struct *mydata;
+	mydata = (data_struct *) data;
+
+	// The vanishing point as in evaluateNieto, with its derivatives by theta and phi
+	double theta = param[0];
+	double phi = param[1];
+	double s[3] = {cos(phi)*sin(theta), sin(phi)*sin(theta), cos(theta)};
+	double sTheta[3] = {cos(phi)*cos(theta), sin(phi)*cos(theta), -sin(theta)};
+	double sPhi[3] = {-sin(phi)*sin(theta), cos(phi)*sin(theta), 0};
+
+	const float *K = mydata->K;
+	double u[3], uTheta[3], uPhi[3];
+	for(int k=0; k<3; k++)
+	{
+		u[k] = K[3*k]*s[0] + K[3*k+1]*s[1] + K[3*k+2]*s[2];
+		uTheta[k] = K[3*k]*sTheta[0] + K[3*k+1]*sTheta[1] + K[3*k+2]*sTheta[2];
+		uPhi[k] = K[3*k]*sPhi[0] + K[3*k+1]*sPhi[1] + K[3*k+2]*sPhi[2];
+	}
+
+	// Cartesian coordinates if the vanishing point is finite: v = u/u2, dv = (du*u2 - u*du2)/u2^2
+	double v[3], vTheta[3], vPhi[3];
+	if((float)u[2] != 0)
+	{
+		for(int k=0; k<2; k++)
+		{
+			v[k] = u[k]/u[2];
+			vTheta[k] = (uTheta[k]*u[2] - u[k]*uTheta[2])/(u[2]*u[2]);
+			vPhi[k] = (uPhi[k]*u[2] - u[k]*uPhi[2])/(u[2]*u[2]);
+		}
+		v[2] = 1;
+		vTheta[2] = 0;
+		vPhi[2] = 0;
+	}
+	else
+	{
+		for(int k=0; k<3; k++)
+		{
+			v[k] = u[k];
+			vTheta[k] = uTheta[k];
+			vPhi[k] = uPhi[k];
+		}
+	}
+
+	// d = |r.n|/(|n||r|) with r = [v1 - v2*c1; v2*c0 - v0] and n = [-l1; l0], so
+	// dd = sign(r.n)*(dr.n)/(|n||r|) - |r.n|*(r.dr)/(|n||r|^3)
+	for(int p=0; p<mydata->setLength; p++)
+	{
+		int i = mydata->set[p];
+		double n0 = -mydata->ly[i], n1 = mydata->lx[i];
+		double nNorm = mydata->nNorm[i];
+		double c0 = mydata->mx[i], c1 = mydata->my[i];
+
+		double r0 = v[1] - v[2]*c1;
+		double r1 = v[2]*c0 - v[0];
+		double rNorm2 = r0*r0 + r1*r1;
+		if(nNorm == 0 || rNorm2 == 0)
+		{
+			fjac[p] = 0;
+			fjac[m_dat + p] = 0;
+			continue;
+		}
+		double rNorm = sqrt(rNorm2);
+		double num = r0*n0 + r1*n1;
+		double sign = num < 0 ? -1 : 1;
+
+		double r0Theta = vTheta[1] - vTheta[2]*c1, r1Theta = vTheta[2]*c0 - vTheta[0];
+		double r0Phi = vPhi[1] - vPhi[2]*c1, r1Phi = vPhi[2]*c0 - vPhi[0];
+		fjac[p] = (sign*(r0Theta*n0 + r1Theta*n1) - fabs(num)*(r0*r0Theta + r1*r1Theta)/rNorm2)/(nNorm*rNorm);
+		fjac[m_dat + p] = (sign*(r0Phi*n0 + r1Phi*n1) - fabs(num)*(r0*r0Phi + r1*r1Phi)/rNorm2)/(nNorm*rNorm);
+	}
+
+	/* to prevent a 'unused variable' warning */
+	*info = *info;
+}
@@ -5,17 +5,27 @@
 #include <opencv/highgui.h>
 #include <opencv/cxcore.h>
 
-/** This is the data structure passed to the Levenberg-Marquardt procedure */
+#include "msacResiduals.h"
+
+/** This is the data structure passed to the Levenberg-Marquardt procedure.
+	The line segments are the entries set[0..setLength-1] of the MSAC data arrays. */
 struct data_struct
 {
-	cv::Mat &LSS;		// Line segments vectors (3xN)	
-	cv::Mat &Lengths;	// Length of line segments (NxN) (diagonal)
-	cv::Mat &midPoints;	// Mid points (c=(a+b)/2) (3xN)	
+	const float *lx;	// General form of the line segments li=[lx;ly;lz] (only lx and ly are used)
+	const float *ly;
+	const float *nNorm;	// Norm of the 2D normal [-ly;lx]
+	const float *mx;	// Mid points [mx;my;1]
+	const float *my;
+	const float *lengths;	// Length of line segments
+
+	const int *set;		// Indexes of the line segments
+	int setLength;
 
-	cv::Mat &K;		// Camera calibration matrix (3x3)
+	const float *K;		// Camera calibration matrix (3x3, row-major)
 
-	data_struct (cv::Mat &_LSS, cv::Mat &_Lengths, cv::Mat &_midPoints, cv::Mat &_K): 
-		LSS(_LSS), Lengths(_Lengths), midPoints(_midPoints), K(_K)
+	data_struct (const float *_lx, const float *_ly, const float *_nNorm, const float *_mx, const float *_my,
+		     const float *_lengths, const int *_set, int _setLength, const float *_K): 
+		lx(_lx), ly(_ly), nNorm(_nNorm), mx(_mx), my(_my), lengths(_lengths), set(_set), setLength(_setLength), K(_K)
 	{
 	}
 };
@@ -29,6 +39,9 @@ float distanceNieto( cv::Mat &vanishingPoint, cv::Mat &lineSegment, float length
 /** This function contains the procedure of estimating a vanishing point given a set of line segments using the method
 	proposed by Marcos Nieto.*/
 void evaluateNieto( const double *param, int m_dat, const void *data, double *fvec, int *info);
+/** This function computes the Jacobian of evaluateNieto in closed form: fjac[j*m_dat+p] is the derivative of the
+	distance of the line segment set[p] by param[j], param being (theta, phi).*/
+void jacobianNieto( const double *param, int m_dat, const void *data, double *fjac, int *info);
 
 
 #endif // __ERRORNIETO_H__
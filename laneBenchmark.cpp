@@ -0,0 +1,399 @@
+/**
+ * compare the speed and the accuracy of the lane detection modes on the frames of an image or a video.
+ *
+ * usage: laneBenchmark [image or video] [maxFrames]
+ *
+ * The frames are decoded first, so only the detection is timed. Each mode runs on its own LaneDetector,
+ * the accuracy is the offset of its lane end points from the reference mode on the same frame:
+ * the full resolution for the pyramid levels, the hough segments for the segment detectors.
+ *
+ * The vanishing point estimation is compared on synthetic line segments, whose vanishing point is known,
+ * so it also runs without frames.
+ */
+#include "roadRoiExtract.h"
+#include <cstdio>
+#include <cstdlib>
+
+using namespace gentech;
+
+#define BENCHMARK_MAX_FRAMES	(100)
+#define BENCHMARK_WIDTH		(1280)	// size of the image of the synthetic line segments
+#define BENCHMARK_HEIGHT	(720)
+#define BENCHMARK_INLIER_RATIO	(0.5)	// fraction of the synthetic line segments through the vanishing point
+#define BENCHMARK_HYPOTHESES	(20000)	// number of hypotheses scored by the cv::Mat residuals
+#define BENCHMARK_SEEDS		(50)	// number of seeds of each sampler on the same line segments
+
+/**
+ * the lanes of one frame, found is false if the detection failed.
+ */
+struct benchmarkResult
+{
+	bool found;
+	lane left;
+	lane right;
+};
+
+/**
+ * a mode of the lane detection.
+ */
+struct benchmarkMode
+{
+	const char* name;
+	int pyramidLevel;
+	int segmentDetector;	// SEGMENT_DETECTOR_HOUGH or SEGMENT_DETECTOR_REGION
+};
+
+static bool loadFrames(const char* path, int maxFrames, std::vector<cv::Mat>& frames)
+{
+	cv::Mat img = cv::imread(path);
+	if (!img.empty()) {
+		frames.push_back(img);
+		return true;
+	}
+
+	cv::VideoCapture capture(path);
+	if (!capture.isOpened()) return false;
+	cv::Mat frame;
+	while ((int)frames.size() < maxFrames && capture.read(frame)) {
+		frames.push_back(frame.clone());
+	}
+	return !frames.empty();
+}
+
+/**
+ * @return the mean time per frame in milliseconds
+ */
+static double runMode(const benchmarkMode& mode, const std::vector<cv::Mat>& frames, std::vector<benchmarkResult>& results)
+{
+	LaneDetector detector;
+	detector.setPyramidLevel(mode.pyramidLevel);
+	detector.setSegmentDetector(mode.segmentDetector);
+
+	results.resize(frames.size());
+	int64 ticks = 0;
+	for (std::size_t i = 0; i < frames.size(); ++i) {
+		int64 start = cv::getTickCount();
+		results[i].found = detector.detect(frames[i], results[i].left, results[i].right);
+		ticks += cv::getTickCount() - start;
+	}
+	return ticks * 1000.0 / cv::getTickFrequency() / frames.size();
+}
+
+static double pointDistance(const cv::Point& a, const cv::Point& b)
+{
+	double dx = a.x - b.x, dy = a.y - b.y;
+	return sqrt(dx * dx + dy * dy);
+}
+
+/**
+ * print the time, the number of detected frames and the end point offsets from the reference.
+ */
+static void printMode(const benchmarkMode& mode, double msPerFrame, const std::vector<benchmarkResult>& results,
+		      const std::vector<benchmarkResult>& reference, double referenceMs)
+{
+	int found = 0, compared = 0;
+	double sumOffset = 0, maxOffset = 0;
+	for (std::size_t i = 0; i < results.size(); ++i) {
+		if (!results[i].found) continue;
+		++found;
+		if (!reference[i].found) continue;
+		++compared;
+		double offsets[4] = {
+			pointDistance(results[i].left.m_top, reference[i].left.m_top),
+			pointDistance(results[i].left.m_bottom, reference[i].left.m_bottom),
+			pointDistance(results[i].right.m_top, reference[i].right.m_top),
+			pointDistance(results[i].right.m_bottom, reference[i].right.m_bottom)
+		};
+		for (int k = 0; k < 4; ++k) {
+			sumOffset += offsets[k];
+			maxOffset = std::max(maxOffset, offsets[k]);
+		}
+	}
+	printf("%-24s %9.2f ms %7.2fx %6d/%-6d", mode.name, msPerFrame, referenceMs / msPerFrame, found, (int)results.size());
+	if (compared > 0) printf(" %8.2f px %8.2f px\n", sumOffset / (4 * compared), maxOffset);
+	else printf(" %11s %11s\n", "-", "-");
+}
+
+/**
+ * run the modes on the frames, the first one is the reference.
+ */
+static void benchmarkModes(const benchmarkMode* modes, int numModes, const std::vector<cv::Mat>& frames)
+{
+	printf("\n%-24s %12s %8s %13s %11s %11s\n", "mode", "time/frame", "speedup", "detected", "mean offset", "max offset");
+	std::vector<benchmarkResult> reference, results;
+	double referenceMs = runMode(modes[0], frames, reference);
+	printMode(modes[0], referenceMs, reference, reference, referenceMs);
+	for (int m = 1; m < numModes; ++m) {
+		double ms = runMode(modes[m], frames, results);
+		printMode(modes[m], ms, results, reference, referenceMs);
+	}
+}
+
+/**
+ * the pyramid levels against the full resolution.
+ */
+static void benchmarkPyramid(const std::vector<cv::Mat>& frames)
+{
+	const benchmarkMode modes[] = {
+		{"pyramid level 0", 0, SEGMENT_DETECTOR_HOUGH},
+		{"pyramid level 1", 1, SEGMENT_DETECTOR_HOUGH},
+		{"pyramid level 2", 2, SEGMENT_DETECTOR_HOUGH}
+	};
+	benchmarkModes(modes, sizeof(modes) / sizeof(modes[0]), frames);
+}
+
+/**
+ * the region growing segment detector against the hough one, at full resolution.
+ */
+static void benchmarkSegmentDetectors(const std::vector<cv::Mat>& frames)
+{
+	const benchmarkMode modes[] = {
+		{"hough segments", 0, SEGMENT_DETECTOR_HOUGH},
+		{"region segments", 0, SEGMENT_DETECTOR_REGION}
+	};
+	benchmarkModes(modes, sizeof(modes) / sizeof(modes[0]), frames);
+}
+
+/**
+ * numLines line segments in an image of BENCHMARK_WIDTH x BENCHMARK_HEIGHT, BENCHMARK_INLIER_RATIO of them
+ * point to vanishingPoint within about a pixel, the others are short segments in random directions.
+ */
+static void syntheticLines(int numLines, const cv::Point2f& vanishingPoint, cv::RNG& rng, std::vector<cv::Vec4i>& lines)
+{
+	lines.resize(numLines);
+	for (int i = 0; i < numLines; ++i) {
+		if (i < numLines * BENCHMARK_INLIER_RATIO) {
+			// a segment of the ray from the vanishing point to a point of the bottom row
+			float bottomX = rng.uniform(-0.5f, 1.5f) * BENCHMARK_WIDTH;
+			float t0 = rng.uniform(0.1f, 0.6f), t1 = t0 + rng.uniform(0.1f, 0.4f);
+			float dx = bottomX - vanishingPoint.x, dy = BENCHMARK_HEIGHT - 1 - vanishingPoint.y;
+			lines[i] = cv::Vec4i(cvRound(vanishingPoint.x + t0 * dx + rng.uniform(-1.0f, 1.0f)),
+					     cvRound(vanishingPoint.y + t0 * dy),
+					     cvRound(vanishingPoint.x + t1 * dx + rng.uniform(-1.0f, 1.0f)),
+					     cvRound(vanishingPoint.y + t1 * dy));
+		} else {
+			// clutter is shorter than the lane markings
+			float x = rng.uniform(0.0f, (float)BENCHMARK_WIDTH), y = rng.uniform(BENCHMARK_HEIGHT / 3.0f, (float)BENCHMARK_HEIGHT);
+			float angle = rng.uniform(0.0f, (float)CV_PI), length = rng.uniform(20.0f, 150.0f);
+			lines[i] = cv::Vec4i(cvRound(x), cvRound(y), cvRound(x + length * cos(angle)), cvRound(y + length * sin(angle)));
+		}
+	}
+}
+
+/**
+ * the hypothesis loop of MSAC before the line segments were kept as plain float arrays:
+ * the minimal sample and the residuals go through 3x1 cv::Mat temporaries, K is inverted for
+ * every hypothesis and the residual is distanceNieto on cv::Mat.
+ *
+ * @return the number of hypotheses per second
+ */
+static double matHypothesesPerSecond(const std::vector<cv::Vec4i>& lines, int numHypotheses, cv::RNG& rng)
+{
+	int numLines = (int)lines.size();
+	cv::Mat K = cv::Mat::zeros(3, 3, CV_32F);
+	K.at<float>(0, 0) = (float)BENCHMARK_WIDTH;
+	K.at<float>(0, 2) = (float)BENCHMARK_WIDTH / 2;
+	K.at<float>(1, 1) = (float)BENCHMARK_HEIGHT;
+	K.at<float>(1, 2) = (float)BENCHMARK_HEIGHT / 2;
+	K.at<float>(2, 2) = 1;
+
+	cv::Mat Li(numLines, 3, CV_32F), Mi(numLines, 3, CV_32F), Lengths(numLines, numLines, CV_32F);
+	Lengths.setTo(0);
+	cv::Mat a(3, 1, CV_32F), b(3, 1, CV_32F);
+	for (int i = 0; i < numLines; ++i) {
+		a.at<float>(0, 0) = (float)lines[i][0]; a.at<float>(1, 0) = (float)lines[i][1]; a.at<float>(2, 0) = 1;
+		b.at<float>(0, 0) = (float)lines[i][2]; b.at<float>(1, 0) = (float)lines[i][3]; b.at<float>(2, 0) = 1;
+		cv::Mat c = 0.5 * (a + b);
+		cv::Mat li = a.cross(b);
+		cv::normalize(li, li);
+		for (int k = 0; k < 3; ++k) {
+			Li.at<float>(i, k) = li.at<float>(k, 0);
+			Mi.at<float>(i, k) = c.at<float>(k, 0);
+		}
+		Lengths.at<float>(i, i) = (float)pointDistance(cv::Point(lines[i][0], lines[i][1]), cv::Point(lines[i][2], lines[i][3]));
+	}
+
+	std::vector<float> E(numLines);
+	float sumJ = 0;
+	int64 start = cv::getTickCount();
+	for (int h = 0; h < numHypotheses; ++h) {
+		int i0 = rng.uniform(0, numLines), i1 = rng.uniform(0, numLines);
+		cv::Mat ls0(3, 1, CV_32F), ls1(3, 1, CV_32F);
+		for (int k = 0; k < 3; ++k) {
+			ls0.at<float>(k, 0) = Li.at<float>(i0, k);
+			ls1.at<float>(k, 0) = Li.at<float>(i1, k);
+		}
+		cv::Mat vp = ls0.cross(ls1);
+		vp = K.inv() * vp;
+		cv::normalize(vp, vp);
+
+		cv::Mat vn = K * vp;
+		if (vn.at<float>(2, 0) != 0) {
+			vn.at<float>(0, 0) /= vn.at<float>(2, 0);
+			vn.at<float>(1, 0) /= vn.at<float>(2, 0);
+			vn.at<float>(2, 0) = 1;
+		}
+		cv::Mat lineSegment(3, 1, CV_32F), midPoint(3, 1, CV_32F);
+		float J = 0;
+		for (int i = 0; i < numLines; ++i) {
+			for (int k = 0; k < 3; ++k) {
+				lineSegment.at<float>(k, 0) = Li.at<float>(i, k);
+				midPoint.at<float>(k, 0) = Mi.at<float>(i, k);
+			}
+			float d = distanceNieto(vn, lineSegment, Lengths.at<float>(i, i), midPoint);
+			E[i] = d * d;
+			J += std::min(E[i], 0.01623f * 2);
+		}
+		sumJ += J;
+	}
+	double seconds = (cv::getTickCount() - start) / cv::getTickFrequency();
+	// sumJ keeps the loop from being optimized away
+	return sumJ >= 0 ? numHypotheses / seconds : 0;
+}
+
+/**
+ * the hypotheses per second of the cv::Mat residuals against MSAC, which scores every pair of line
+ * segments in the exhaustive mode. The MSAC time also holds the data setup and the reestimation.
+ */
+static void benchmarkResiduals()
+{
+	const int numLines[] = {50, 100, 200};
+	const int numSizes = sizeof(numLines) / sizeof(numLines[0]);
+	cv::Point2f vanishingPoint(BENCHMARK_WIDTH * 0.5f, BENCHMARK_HEIGHT * 0.4f);
+
+	printf("\n%-24s %16s %16s %8s\n", "residuals", "cv::Mat hyp/s", "MSAC hyp/s", "speedup");
+	for (int n = 0; n < numSizes; ++n) {
+		cv::RNG rng(n + 1);
+		std::vector<cv::Vec4i> lines;
+		syntheticLines(numLines[n], vanishingPoint, rng, lines);
+		double matRate = matHypothesesPerSecond(lines, BENCHMARK_HYPOTHESES, rng);
+
+		MSAC msac;
+		msac.init(MODE_NIETO, cv::Size(BENCHMARK_WIDTH, BENCHMARK_HEIGHT));
+		msac.setExhaustive(numLines[n]);
+		std::vector<int> clusterIndices, clusterOffsets, numInliers;
+		std::vector<cv::Mat> vps;
+		int hypotheses = 0;
+		int64 ticks = 0;
+		while (hypotheses < BENCHMARK_HYPOTHESES) {
+			numInliers.clear();
+			vps.clear();
+			int64 start = cv::getTickCount();
+			msac.multipleVPEstimation(lines, clusterIndices, clusterOffsets, numInliers, vps, 1);
+			ticks += cv::getTickCount() - start;
+			hypotheses += msac.getStats().iterations;
+		}
+		double msacRate = hypotheses * cv::getTickFrequency() / ticks;
+
+		char name[32];
+		sprintf(name, "%d line segments", numLines[n]);
+		printf("%-24s %16.0f %16.0f %7.2fx\n", name, matRate, msacRate, msacRate / matRate);
+	}
+}
+
+/**
+ * a sampler of the vanishing point hypotheses.
+ */
+struct benchmarkSampler
+{
+	const char* name;
+	int sampler;		// SAMPLER_UNIFORM or SAMPLER_PROSAC
+	bool exhaustive;	// all the pairs of line segments, see MSAC::setExhaustive
+};
+
+static void meanAndDeviation(const std::vector<double>& values, double& mean, double& deviation)
+{
+	mean = 0;
+	for (std::size_t i = 0; i < values.size(); ++i) mean += values[i];
+	mean /= values.size();
+	deviation = 0;
+	for (std::size_t i = 0; i < values.size(); ++i) deviation += (values[i] - mean) * (values[i] - mean);
+	deviation = sqrt(deviation / values.size());
+}
+
+/**
+ * the latency, the iterations and the vanishing point of the samplers over BENCHMARK_SEEDS seeds.
+ * The error is the distance of the vanishing point to the true one, the spread is the deviation of
+ * the vanishing points of the seeds around their mean.
+ */
+static void benchmarkSamplers()
+{
+	const int numLines[] = {50, 100, 200};
+	const int numSizes = sizeof(numLines) / sizeof(numLines[0]);
+	const benchmarkSampler samplers[] = {
+		{"uniform", SAMPLER_UNIFORM, false},
+		{"PROSAC", SAMPLER_PROSAC, false},
+		{"exhaustive", SAMPLER_UNIFORM, true}
+	};
+	const int numSamplers = sizeof(samplers) / sizeof(samplers[0]);
+	cv::Point2f vanishingPoint(BENCHMARK_WIDTH * 0.45f, BENCHMARK_HEIGHT * 0.35f);
+
+	printf("\n%-24s %10s %10s %10s %10s %10s\n", "sampler", "mean ms", "dev ms", "iterations", "error px", "spread px");
+	for (int n = 0; n < numSizes; ++n) {
+		cv::RNG rng(n + 100);
+		std::vector<cv::Vec4i> lines;
+		syntheticLines(numLines[n], vanishingPoint, rng, lines);
+
+		for (int k = 0; k < numSamplers; ++k) {
+			std::vector<double> ms, iterations, errors, xs, ys;
+			std::vector<int> clusterIndices, clusterOffsets, numInliers;
+			std::vector<cv::Mat> vps;
+			for (int seed = 1; seed <= BENCHMARK_SEEDS; ++seed) {
+				MSAC msac;
+				msac.init(MODE_NIETO, cv::Size(BENCHMARK_WIDTH, BENCHMARK_HEIGHT), false, seed);
+				msac.setSampler(samplers[k].sampler);
+				if (samplers[k].exhaustive) msac.setExhaustive(numLines[n]);
+
+				numInliers.clear();
+				vps.clear();
+				int64 start = cv::getTickCount();
+				msac.multipleVPEstimation(lines, clusterIndices, clusterOffsets, numInliers, vps, 1);
+				ms.push_back((cv::getTickCount() - start) * 1000.0 / cv::getTickFrequency());
+				iterations.push_back(msac.getStats().iterations);
+				if (vps.empty() || vps[0].at<float>(2, 0) == 0) continue;
+
+				double x = vps[0].at<float>(0, 0) / vps[0].at<float>(2, 0);
+				double y = vps[0].at<float>(1, 0) / vps[0].at<float>(2, 0);
+				xs.push_back(x);
+				ys.push_back(y);
+				errors.push_back(sqrt((x - vanishingPoint.x) * (x - vanishingPoint.x) + (y - vanishingPoint.y) * (y - vanishingPoint.y)));
+			}
+
+			double msMean, msDeviation, iterationsMean, dummy, errorMean, xDeviation, yDeviation;
+			meanAndDeviation(ms, msMean, msDeviation);
+			meanAndDeviation(iterations, iterationsMean, dummy);
+			char name[32];
+			sprintf(name, "%s, %d lines", samplers[k].name, numLines[n]);
+			printf("%-24s %10.3f %10.3f %10.1f", name, msMean, msDeviation, iterationsMean);
+			if (errors.empty()) {
+				printf(" %10s %10s\n", "-", "-");
+				continue;
+			}
+			meanAndDeviation(errors, errorMean, dummy);
+			meanAndDeviation(xs, dummy, xDeviation);
+			meanAndDeviation(ys, dummy, yDeviation);
+			printf(" %10.2f %10.2f\n", errorMean, sqrt(xDeviation * xDeviation + yDeviation * yDeviation));
+		}
+	}
+}
+
+int main(int argc, char** argv)
+{
+	if (argc > 1) {
+		int maxFrames = argc > 2 ? atoi(argv[2]) : BENCHMARK_MAX_FRAMES;
+		std::vector<cv::Mat> frames;
+		if (!loadFrames(argv[1], maxFrames, frames)) {
+			printf("can not read %s\n", argv[1]);
+			return 1;
+		}
+		printf("%d frames of %d x %d\n", (int)frames.size(), frames[0].cols, frames[0].rows);
+
+		// the offsets are the mean and the maximum distance of the 4 lane end points from the first mode of each table
+		benchmarkPyramid(frames);
+		benchmarkSegmentDetectors(frames);
+	}
+
+	benchmarkResiduals();
+	benchmarkSamplers();
+	return 0;
+}
@@ -0,0 +1,197 @@
+#include "lineHough.h"
+#include <algorithm>
+
+namespace gentech
+{
+
+bool isOrientationInRanges(float orientation, const std::vector<cv::Vec2f>& ranges)
+{
+	for (std::size_t i = 0; i < ranges.size(); ++i) {
+		float from = ranges[i][0], to = ranges[i][1];
+		if ((from <= to && orientation >= from && orientation <= to) ||
+		    (from > to && (orientation >= from || orientation <= to))) return true;
+	}
+	return false;
+}
+
+LineHough::LineHough()
+	: m_threshold(70),
+	  m_minLineLength(20),
+	  m_maxLineGap(10),
+	  m_orientationTolerance(5),
+	  m_numAngle(180),
+	  m_numRho(0)
+{
+	// 1 degree and 1 pixel resolution, same as the cv::HoughLinesP calls of the lane detector
+	m_cos.resize(m_numAngle);
+	m_sin.resize(m_numAngle);
+	for (int n = 0; n < m_numAngle; ++n) {
+		m_cos[n] = (float)cos(n * CV_PI / m_numAngle);
+		m_sin[n] = (float)sin(n * CV_PI / m_numAngle);
+		m_thetas.push_back(n);
+		m_thetaIndex.push_back(n);
+	}
+}
+
+void LineHough::setParams(int threshold, int minLineLength, int maxLineGap)
+{
+	m_threshold = threshold;
+	m_minLineLength = minLineLength;
+	m_maxLineGap = maxLineGap;
+}
+
+void LineHough::setOrientationRanges(const std::vector<cv::Vec2f>& ranges)
+{
+	m_thetas.clear();
+	for (int n = 0; n < m_numAngle; ++n) {
+		// theta is the angle of the line normal
+		float orientation = (float)((n * 180 / m_numAngle + 90) % 180);
+		if (isOrientationInRanges(orientation, ranges)) m_thetas.push_back(n);
+	}
+
+	m_thetaIndex.assign(m_numAngle, -1);
+	for (std::size_t k = 0; k < m_thetas.size(); ++k) m_thetaIndex[m_thetas[k]] = (int)k;
+}
+
+void LineHough::setOrientationTolerance(int degrees)
+{
+	m_orientationTolerance = std::max(0, std::min(degrees, m_numAngle / 2));
+}
+
+bool LineHough::peakCompare(const peak& a, const peak& b)
+{
+	if (a.votes != b.votes) return a.votes > b.votes;
+	return a.index < b.index;
+}
+
+void LineHough::vote(const cv::Mat& img, const cv::Mat* orientation)
+{
+	m_points.clear();
+	m_pointOrientations.clear();
+	for (int y = 0; y < img.rows; ++y) {
+		const unsigned char* p = img.ptr<unsigned char>(y);
+		const unsigned char* o = orientation != NULL ? orientation->ptr<unsigned char>(y) : NULL;
+		for (int x = 0; x < img.cols; ++x) {
+			if (!p[x]) continue;
+			m_points.push_back(cv::Point(x, y));
+			m_pointOrientations.push_back(o != NULL ? o[x] : (unsigned char)m_numAngle);
+		}
+	}
+
+	m_numRho = 2 * (img.cols + img.rows) + 1;
+	int rhoOffset = (m_numRho - 1) / 2;
+	int numTheta = (int)m_thetas.size();
+	m_accum.assign(numTheta * m_numRho, 0);
+	for (std::size_t i = 0; i < m_points.size(); ++i) {
+		float x = (float)m_points[i].x, y = (float)m_points[i].y;
+		int* acc = &m_accum[0] + rhoOffset;
+		int o = m_pointOrientations[i];
+		if (o >= m_numAngle) {
+			for (int k = 0; k < numTheta; ++k, acc += m_numRho) {
+				int n = m_thetas[k];
+				++acc[cvRound(x * m_cos[n] + y * m_sin[n])];
+			}
+			continue;
+		}
+		// the theta bins wrap around, theta + 180 is the same line with -rho,
+		// which the cos and sin of the wrapped bin already give
+		for (int d = -m_orientationTolerance; d <= m_orientationTolerance; ++d) {
+			int n = (o + d + m_numAngle) % m_numAngle;
+			int k = m_thetaIndex[n];
+			if (k < 0) continue;
+			++acc[k * m_numRho + cvRound(x * m_cos[n] + y * m_sin[n])];
+		}
+	}
+}
+
+void LineHough::findPeaks()
+{
+	// local maximums in the 4 neighbourhood, same rule as cv::HoughLines
+	// (the theta neighbours only if they are in the accumulator)
+	m_peaks.clear();
+	int numTheta = (int)m_thetas.size();
+	for (int k = 0; k < numTheta; ++k) {
+		const int* acc = &m_accum[k * m_numRho];
+		bool hasPrev = k > 0 && m_thetas[k - 1] == m_thetas[k] - 1;
+		bool hasNext = k < numTheta - 1 && m_thetas[k + 1] == m_thetas[k] + 1;
+		for (int r = 1; r < m_numRho - 1; ++r) {
+			int v = acc[r];
+			if (v <= m_threshold || v <= acc[r - 1] || v < acc[r + 1]) continue;
+			if (hasPrev && v <= acc[r - m_numRho]) continue;
+			if (hasNext && v < acc[r + m_numRho]) continue;
+			peak pk;
+			pk.votes = v;
+			pk.index = k * m_numRho + r;
+			m_peaks.push_back(pk);
+		}
+	}
+}
+
+void LineHough::extractSegments(cv::Mat& img, int theta, int rho, std::vector<cv::Vec4i>& lines, int maxLines)
+{
+	float c = m_cos[theta], s = m_sin[theta];
+	float r = (float)(rho - (m_numRho - 1) / 2);
+	// walk along the major axis of the line
+	bool alongX = std::abs(s) > std::abs(c);
+	int len = alongX ? img.cols : img.rows;
+
+	int start = -1, last = -1;
+	for (int t = 0; t <= len; ++t) {
+		bool on = false;
+		if (t < len) {
+			int x = alongX ? t : cvRound((r - t * s) / c);
+			int y = alongX ? cvRound((r - t * c) / s) : t;
+			on = x >= 0 && x < img.cols && y >= 0 && y < img.rows && img.at<unsigned char>(y, x) != 0;
+		}
+		if (on) {
+			if (start < 0) start = t;
+			last = t;
+			continue;
+		}
+		if (start < 0 || (t < len && t - last <= m_maxLineGap)) continue;
+
+		cv::Point a, b;
+		a = alongX ? cv::Point(start, cvRound((r - start * c) / s)) : cv::Point(cvRound((r - start * s) / c), start);
+		b = alongX ? cv::Point(last, cvRound((r - last * c) / s)) : cv::Point(cvRound((r - last * s) / c), last);
+		if (std::abs(b.x - a.x) >= m_minLineLength || std::abs(b.y - a.y) >= m_minLineLength) {
+			lines.push_back(cv::Vec4i(a.x, a.y, b.x, b.y));
+			// clear the segment and its neighbours across the line, the weaker peaks of
+			// the same line marking should not find it again
+			for (int k = start; k <= last; ++k) {
+				int x = alongX ? k : cvRound((r - k * s) / c);
+				int y = alongX ? cvRound((r - k * c) / s) : k;
+				for (int d = -1; d <= 1; ++d) {
+					int xd = alongX ? x : x + d;
+					int yd = alongX ? y + d : y;
+					if (xd >= 0 && xd < img.cols && yd >= 0 && yd < img.rows) img.at<unsigned char>(yd, xd) = 0;
+				}
+			}
+			if ((int)lines.size() >= maxLines) return;
+		}
+		start = -1;
+	}
+}
+
+void LineHough::detect(cv::Mat& img, std::vector<cv::Vec4i>& lines, int maxLines, const cv::Mat* orientation)
+{
+	CV_Assert(img.type() == CV_8UC1);
+	CV_Assert(orientation == NULL || (orientation->type() == CV_8UC1 && orientation->size() == img.size()));
+
+	lines.clear();
+	if (img.empty() || maxLines <= 0 || m_thetas.empty()) return;
+
+	vote(img, orientation);
+	findPeaks();
+
+	// only the strongest peaks are ordered, the rest only if they are not enough
+	std::size_t sorted = 0;
+	for (std::size_t i = 0; i < m_peaks.size() && (int)lines.size() < maxLines; ++i) {
+		if (i == sorted) {
+			sorted = std::min(m_peaks.size(), std::max<std::size_t>(2 * sorted, 2 * maxLines));
+			std::partial_sort(m_peaks.begin() + i, m_peaks.begin() + sorted, m_peaks.end(), peakCompare);
+		}
+		extractSegments(img, m_thetas[m_peaks[i].index / m_numRho], m_peaks[i].index % m_numRho, lines, maxLines);
+	}
+}
+
+}
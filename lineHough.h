@@ -0,0 +1,99 @@
+#ifndef _LINE_HOUGH_H_
+#define _LINE_HOUGH_H_
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+namespace gentech
+{
+
+/**
+ * @param orientation the orientation of a line in degrees, in [0, 180)
+ * @param ranges the allowed [from, to] orientations, a range with from > to wraps around 180
+ *
+ * @return true if orientation is in one of the ranges
+ */
+bool isOrientationInRanges(float orientation, const std::vector<cv::Vec2f>& ranges);
+
+/**
+ * probabilistic hough like line segment detector, which returns the strongest segments directly.
+ *
+ * The accumulator is built once from all the foreground pixels, its peaks are then visited from
+ * the most voted one and the segments on each peak line are extracted like cv::HoughLinesP does,
+ * until the requested number of segments is reached. So the run time does not depend on how many
+ * segments the image contains.
+ *
+ * Only the orientations allowed by setOrientationRanges are voted and searched.
+ * If the local orientation of the pixels is known, each pixel only votes near its own orientation.
+ *
+ * The accumulator and the other buffers are kept between the calls.
+ */
+class LineHough
+{
+public:
+	LineHough();
+
+	/**
+	 * @param threshold the minimum votes of a line
+	 * @param minLineLength the minimum length of a segment
+	 * @param maxLineGap the maximum gap between two points of the same segment
+	 */
+	void setParams(int threshold, int minLineLength, int maxLineGap);
+
+	/**
+	 * restrict the orientations of the detected lines, all orientations are allowed by default.
+	 *
+	 * @param ranges the allowed [from, to] orientations in degrees, measured from the x axis
+	 *               of the image in [0, 180). A range with from > to wraps around 180.
+	 */
+	void setOrientationRanges(const std::vector<cv::Vec2f>& ranges);
+
+	/**
+	 * @param degrees a pixel with a known orientation votes for the theta bins
+	 *                within this many degrees of it, see detect
+	 */
+	void setOrientationTolerance(int degrees);
+
+	/**
+	 * detect the strongest segments in the binary image.
+	 *
+	 * @param[in, out] img the binary image, the pixels of the detected segments are cleared
+	 * @param[in, out] lines the detected segments, strongest first
+	 * @param[in] maxLines the maximum number of segments
+	 * @param[in] orientation optional, the theta bin (in degrees) of the line normal at every pixel
+	 *                        of img, the pixels with a value >= 180 vote for all the theta bins
+	 */
+	void detect(cv::Mat& img, std::vector<cv::Vec4i>& lines, int maxLines, const cv::Mat* orientation = NULL);
+
+private:
+	struct peak
+	{
+		int votes;
+		int index;	// index in the accumulator, thetaIndex * numRho + rho
+	};
+	static bool peakCompare(const peak& a, const peak& b);
+
+	void vote(const cv::Mat& img, const cv::Mat* orientation);
+	void findPeaks();
+	void extractSegments(cv::Mat& img, int theta, int rho, std::vector<cv::Vec4i>& lines, int maxLines);
+
+	int m_threshold;
+	int m_minLineLength;
+	int m_maxLineGap;
+	int m_orientationTolerance;
+
+	int m_numAngle;
+	int m_numRho;
+	std::vector<float> m_cos;
+	std::vector<float> m_sin;
+	std::vector<int> m_thetas;	// the theta bins in the accumulator
+	std::vector<int> m_thetaIndex;	// the accumulator row of each theta bin, -1 if not in it
+	std::vector<int> m_accum;
+	std::vector<cv::Point> m_points;
+	std::vector<unsigned char> m_pointOrientations;
+	std::vector<peak> m_peaks;
+};
+
+}
+
+#endif /* _LINE_HOUGH_H_ */
@@ -148,6 +148,39 @@ void lm_printout_std( int n_par, const double *par, int m_dat,
 }
 
 
+/*****************************************************************************/
+/*  lm_workspace (work space of lmmin_ws, allocated by the caller)           */
+/*****************************************************************************/
+
+size_t lm_workspace_size( int n_par, int m_dat )
+{
+    int n = n_par;
+    int m = m_dat;
+
+    /* fvec, wa4 and fjac have m entries per column, diag, qtf and wa1..wa3 n */
+    return (size_t)(2*m + n*m + 5*n) * sizeof(double) + (size_t)n * sizeof(int);
+}
+
+void lm_workspace_init( lm_workspace *ws, int n_par, int m_dat, void *memory )
+{
+    int n = n_par;
+    int m = m_dat;
+    double *p = (double *) memory;
+
+    ws->n_par = n_par;
+    ws->m_dat = m_dat;
+    ws->fvec = p; p += m;
+    ws->wa4  = p; p += m;
+    ws->fjac = p; p += n*m;
+    ws->diag = p; p += n;
+    ws->qtf  = p; p += n;
+    ws->wa1  = p; p += n;
+    ws->wa2  = p; p += n;
+    ws->wa3  = p; p += n;
+    ws->ipvt = (int *) p;
+}
+
+
 /*****************************************************************************/
 /*  lm_minimize (intermediate-level interface)                               */
 /*****************************************************************************/
@@ -160,64 +193,97 @@ void lmmin( int n_par, double *par, int m_dat, const void *data,
                               const void *data, const double *fvec,
                               int printflags, int iflag, int iter, int nfev) )
 {
+    lmmin_der( n_par, par, m_dat, data, evaluate, 0, control, status,
+               printout );
+} /*** lm_minimize. ***/
+
+
+/*****************************************************************************/
+/*  lmmin_der (same as lmmin, with the Jacobian of the user)                 */
+/*****************************************************************************/
+
+void lmmin_der( int n_par, double *par, int m_dat, const void *data, 
+            void (*evaluate) (const double *par, int m_dat, const void *data,
+                              double *fvec, int *info),
+            void (*jacobian) (const double *par, int m_dat, const void *data,
+                              double *fjac, int *info),
+            const lm_control_struct *control, lm_status_struct *status,
+            void (*printout) (int n_par, const double *par, int m_dat,
+                              const void *data, const double *fvec,
+                              int printflags, int iflag, int iter, int nfev) )
+{
 
 /*** allocate work space. ***/
 
-    double *fvec, *diag, *fjac, *qtf, *wa1, *wa2, *wa3, *wa4;
-    int *ipvt;
+    lm_workspace ws;
+    void *memory;
+
+    if ( (memory = malloc(lm_workspace_size(n_par, m_dat))) == NULL ) {
+	status->info = 9;
+	return;
+    }
+    lm_workspace_init( &ws, n_par, m_dat, memory );
+
+/*** perform fit. ***/
+
+    lmmin_ws( n_par, par, m_dat, data, evaluate, jacobian, control, status,
+              printout, &ws );
+
+/*** clean up. ***/
+
+    free(memory);
+} /*** lmmin_der. ***/
 
+
+/*****************************************************************************/
+/*  lmmin_ws (same as lmmin_der, in the work space of the caller)            */
+/*****************************************************************************/
+
+void lmmin_ws( int n_par, double *par, int m_dat, const void *data, 
+            void (*evaluate) (const double *par, int m_dat, const void *data,
+                              double *fvec, int *info),
+            void (*jacobian) (const double *par, int m_dat, const void *data,
+                              double *fjac, int *info),
+            const lm_control_struct *control, lm_status_struct *status,
+            void (*printout) (int n_par, const double *par, int m_dat,
+                              const void *data, const double *fvec,
+                              int printflags, int iflag, int iter, int nfev),
+            lm_workspace *ws )
+{
     int n = n_par;
     int m = m_dat;
 
-    if ( (fvec = (double *) malloc(m * sizeof(double))) == NULL ||
-	 (diag = (double *) malloc(n * sizeof(double))) == NULL ||
-	 (qtf  = (double *) malloc(n * sizeof(double))) == NULL ||
-	 (fjac = (double *) malloc(n*m*sizeof(double))) == NULL ||
-	 (wa1  = (double *) malloc(n * sizeof(double))) == NULL ||
-	 (wa2  = (double *) malloc(n * sizeof(double))) == NULL ||
-	 (wa3  = (double *) malloc(n * sizeof(double))) == NULL ||
-	 (wa4  = (double *) malloc(m * sizeof(double))) == NULL ||
-	 (ipvt = (int *)    malloc(n * sizeof(int)   )) == NULL    ) {
-	status->info = 9;
+    if ( n > ws->n_par || m > ws->m_dat ) {
+	status->info = 10;
 	return;
     }
 
     int j;
     if( ! control->scale_diag )
         for( j=0; j<n_par; ++j )
-            diag[j] = 1;
+            ws->diag[j] = 1;
 
 /*** perform fit. ***/
 
     status->info = 0;
 
-    /* this goes through the modified legacy interface: */
-    lm_lmdif( m, n, par, fvec, control->ftol, control->xtol, control->gtol,
-              control->maxcall * (n + 1), control->epsilon, diag,
-              ( control->scale_diag ? 1 : 2 ),
+    /* forward differences take n calls of evaluate per iteration,
+       the jacobian of the user one call of jacobian: */
+    lm_lmder( m, n, par, ws->fvec, control->ftol, control->xtol, control->gtol,
+              control->maxcall * ( jacobian ? 2 : n + 1 ), control->epsilon,
+              ws->diag, ( control->scale_diag ? 1 : 2 ),
               control->stepbound, &(status->info),
-              &(status->nfev), fjac, ipvt, qtf, wa1, wa2, wa3, wa4,
-              evaluate, printout, control->printflags, data );
+              &(status->nfev), ws->fjac, ws->ipvt, ws->qtf,
+              ws->wa1, ws->wa2, ws->wa3, ws->wa4,
+              evaluate, jacobian, printout, control->printflags, data );
 
     if ( printout )
-        (*printout)( n, par, m, data, fvec,
+        (*printout)( n, par, m, data, ws->fvec,
                      control->printflags, -1, 0, status->nfev );
-    status->fnorm = lm_enorm(m, fvec);
+    status->fnorm = lm_enorm(m, ws->fvec);
     if ( status->info < 0 )
 	status->info = 11;
-
-/*** clean up. ***/
-
-    free(fvec);
-    free(diag);
-    free(qtf);
-    free(fjac);
-    free(wa1);
-    free(wa2);
-    free(wa3);
-    free(wa4);
-    free(ipvt);
-} /*** lm_minimize. ***/
+} /*** lmmin_ws. ***/
 
 
 /*****************************************************************************/
@@ -248,6 +314,30 @@ void lm_lmdif( int m, int n, double *x, double *fvec, double ftol,
                                  const void *data, const double *fvec,
                                  int printflags, int iflag, int iter, int nfev),
 	       int printflags, const void *data )
+{
+    lm_lmder( m, n, x, fvec, ftol, xtol, gtol, maxfev, epsfcn, diag, mode,
+              factor, info, nfev, fjac, ipvt, qtf, wa1, wa2, wa3, wa4,
+              evaluate, 0, printout, printflags, data );
+} /*** lm_lmdif. ***/
+
+
+/*****************************************************************************/
+/*  lm_lmder (lm_lmdif with an optional Jacobian of the user)                */
+/*****************************************************************************/
+
+void lm_lmder( int m, int n, double *x, double *fvec, double ftol,
+	       double xtol, double gtol, int maxfev, double epsfcn,
+	       double *diag, int mode, double factor, int *info, int *nfev,
+	       double *fjac, int *ipvt, double *qtf, double *wa1,
+	       double *wa2, double *wa3, double *wa4,
+               void (*evaluate) (const double *par, int m_dat, const void *data,
+                                 double *fvec, int *info),
+               void (*jacobian) (const double *par, int m_dat, const void *data,
+                                 double *fjac, int *info),
+               void (*printout) (int n_par, const double *par, int m_dat,
+                                 const void *data, const double *fvec,
+                                 int printflags, int iflag, int iter, int nfev),
+	       int printflags, const void *data )
 {
 /*
  *   The purpose of lmdif is to minimize the sum of the squares of
@@ -390,6 +480,11 @@ void lm_lmdif( int m, int n, double *x, double *fvec, double ftol,
  *           //     set *info to a negative integer.
  *        }
  *
+ *      jacobian points to the subroutine which calculates the jacobian,
+ *        fjac[j*m_dat+i] being the derivative of fvec[i] by par[j]. Its
+ *        calls are counted in nfev. With jacobian=0, the jacobian is
+ *        calculated by forward differences (lm_lmdif).
+ *
  *      printout points to the subroutine which informs about fit progress.
  *        Call with printout=0 if no printout is desired.
  *        Call with printout=lm_printout_std to use the default implementation.
@@ -400,7 +495,7 @@ void lm_lmdif( int m, int n, double *x, double *fvec, double ftol,
  *        evaluate. Typically, it contains experimental data to be fitted.
  *
  */
-    int i, iter, j;
+    int i, iter, j, firstStep;
     double actred, delta, dirder, eps, fnorm, fnorm1, gnorm, par, pnorm,
 	prered, ratio, step, sum, temp, temp1, temp2, temp3, xnorm;
     static double p1 = 0.1;
@@ -408,6 +503,7 @@ void lm_lmdif( int m, int n, double *x, double *fvec, double ftol,
 
     *nfev = 0;			/* function evaluation counter */
     iter = 0;			/* outer loop counter */
+    firstStep = 1;
     par = 0;			/* levenberg-marquardt parameter */
     delta = 0;	 /* to prevent a warning (initialization within if-clause) */
     xnorm = 0;	 /* ditto */
@@ -458,7 +554,14 @@ void lm_lmdif( int m, int n, double *x, double *fvec, double ftol,
 
 /*** outer: calculate the Jacobian. ***/
 
-	for (j = 0; j < n; j++) {
+	if (jacobian) {
+	    *info = 0;
+	    (*jacobian) (x, m, data, fjac, info);
+	    ++(*nfev);
+	    if (*info < 0)
+		return;	/* user requested break */
+	}
+	else for (j = 0; j < n; j++) {
 	    temp = x[j];
 	    step = MAX(eps*eps, eps * fabs(temp));
 	    x[j] = temp + step; /* replace temporarily */
@@ -567,8 +670,9 @@ void lm_lmdif( int m, int n, double *x, double *fvec, double ftol,
 
             /* at first call, adjust the initial step bound. */
 
-	    if (*nfev <= 1+n)
+	    if (firstStep)
 		delta = MIN(delta, pnorm);
+	    firstStep = 0;
 
 /*** inner: evaluate the function at x + p and calculate its norm. ***/
 
@@ -13,6 +13,8 @@
 #ifndef LMMIN_H
 #define LMMIN_H
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -39,6 +41,15 @@ typedef struct {
     int info;	      /* status of minimization. */
 } lm_status_struct;
 
+/* Work space of lmmin_ws, for up to n_par parameters and m_dat data points.
+   The arrays point into one block of memory of the caller. */
+typedef struct {
+    int n_par;
+    int m_dat;
+    double *fvec, *diag, *fjac, *qtf, *wa1, *wa2, *wa3, *wa4;
+    int *ipvt;
+} lm_workspace;
+
 /* Recommended control parameter settings. */
 extern const lm_control_struct lm_control_double;
 extern const lm_control_struct lm_control_float;
@@ -60,6 +71,42 @@ void lmmin( int n_par, double *par, int m_dat, const void *data,
                               const void *data, const double *fvec,
                               int printflags, int iflag, int iter, int nfev) );
 
+/* The same minimization with the Jacobian computed by the user:
+   fjac[j*m_dat+i] is the derivative of fvec[i] by par[j]. control->epsilon
+   is not used, control->maxcall is the maximum number of iterations.
+   If jacobian is 0, it is the same as lmmin. */
+void lmmin_der( int n_par, double *par, int m_dat, const void *data, 
+            void (*evaluate) (const double *par, int m_dat, const void *data,
+                              double *fvec, int *info),
+            void (*jacobian) (const double *par, int m_dat, const void *data,
+                              double *fjac, int *info),
+            const lm_control_struct *control, lm_status_struct *status,
+            void (*printout) (int n_par, const double *par, int m_dat,
+                              const void *data, const double *fvec,
+                              int printflags, int iflag, int iter, int nfev) );
+
+/* Size in bytes of the memory of a work space. */
+size_t lm_workspace_size( int n_par, int m_dat );
+
+/* Lays out ws in memory, which must hold lm_workspace_size(n_par, m_dat)
+   bytes aligned for double. The memory is not initialized. */
+void lm_workspace_init( lm_workspace *ws, int n_par, int m_dat, void *memory );
+
+/* The same minimization as lmmin_der (as lmmin if jacobian is 0) without
+   allocating: the arrays of ws are used, so it can be kept between the calls.
+   n_par and m_dat may be smaller than the ones of ws, status->info is 10
+   if they are larger. */
+void lmmin_ws( int n_par, double *par, int m_dat, const void *data, 
+            void (*evaluate) (const double *par, int m_dat, const void *data,
+                              double *fvec, int *info),
+            void (*jacobian) (const double *par, int m_dat, const void *data,
+                              double *fjac, int *info),
+            const lm_control_struct *control, lm_status_struct *status,
+            void (*printout) (int n_par, const double *par, int m_dat,
+                              const void *data, const double *fvec,
+                              int printflags, int iflag, int iter, int nfev),
+            lm_workspace *ws );
+
 
 /** Legacy low-level interface. **/
 
@@ -77,6 +124,22 @@ void lm_lmdif( int m, int n, double *x, double *fvec, double ftol,
                                  int printflags, int iflag, int iter, int nfev),
                int printflags, const void *data );
 
+/* The same, with the jacobian of the user (see lmmin_der), or forward
+   differences if jacobian is 0. */
+void lm_lmder( int m, int n, double *x, double *fvec, double ftol,
+	       double xtol, double gtol, int maxfev, double epsfcn,
+	       double *diag, int mode, double factor, int *info, int *nfev,
+	       double *fjac, int *ipvt, double *qtf, double *wa1,
+	       double *wa2, double *wa3, double *wa4,
+               void (*evaluate) (const double *par, int m_dat, const void *data,
+                                 double *fvec, int *info),
+               void (*jacobian) (const double *par, int m_dat, const void *data,
+                                 double *fjac, int *info),
+               void (*printout) (int n_par, const double *par, int m_dat,
+                                 const void *data, const double *fvec,
+                                 int printflags, int iflag, int iter, int nfev),
+	       int printflags, const void *data );
+
 extern const char *lm_infmsg[];
 extern const char *lm_shortmsg[];
 
@@ -0,0 +1,129 @@
+#include "msacResiduals.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MSAC_X86
+#include <immintrin.h>
+#endif
+
+// Residuals of a batch of hypotheses ---------------------------------------------------------------
+// The loops run over the line segments outside and over the hypotheses inside, so each line segment is
+// read once per batch. The AVX2 kernels do the same float operations in the same order as the scalar
+// ones, 8 line segments at a time. The residuals (and the consensus sets) are then bit-identical as long
+// as the scalar code does not use the x87 unit or contract the products into FMA (e.g. -march=native),
+// which the flags of the Makefile do not; msacResidualsTest checks it.
+
+/** LS residuals of the line segments [begin, numLines), v are the calibrated vanishing points with norms vNorm*/
+static void residualsLSScalar(const msacResidualData &data, int begin, const float *v, const double *vNorm, int numHyp, float *E)
+{
+	int n = data.numLines;
+	for(int i=begin; i<n; i++)
+	{
+		for(int h=0; h<numHyp; h++)
+		{
+			const float *vp = v + 3*h;
+			float di = vp[0]*data.lx[i] + vp[1]*data.ly[i] + vp[2]*data.lz[i];
+			di /= (float)(vNorm[h]*data.lNorm[i]);
+			E[h*n + i] = di*di;
+		}
+	}
+}
+
+/** Nieto residuals of the line segments [begin, numLines), v are the uncalibrated vanishing points*/
+static void residualsNietoScalar(const msacResidualData &data, int begin, const float *v, const double *, int numHyp, float *E)
+{
+	int n = data.numLines;
+	for(int i=begin; i<n; i++)
+	{
+		for(int h=0; h<numHyp; h++)
+		{
+			float di = distanceNieto(v + 3*h, data.lx[i], data.ly[i], data.nNorm[i], data.mx[i], data.my[i]);
+			E[h*n + i] = di*di;
+		}
+	}
+}
+
+#ifdef MSAC_X86
+__attribute__((target("avx2")))
+static void residualsLSAVX2(const msacResidualData &data, int begin, const float *v, const double *vNorm, int numHyp, float *E)
+{
+	int n = data.numLines;
+	int i = begin;
+	for(; i+8<=n; i+=8)
+	{
+		__m256 lx = _mm256_loadu_ps(data.lx + i);
+		__m256 ly = _mm256_loadu_ps(data.ly + i);
+		__m256 lz = _mm256_loadu_ps(data.lz + i);
+		__m256 lNorm = _mm256_loadu_ps(data.lNorm + i);
+		__m256d lNormLo = _mm256_cvtps_pd(_mm256_castps256_ps128(lNorm));
+		__m256d lNormHi = _mm256_cvtps_pd(_mm256_extractf128_ps(lNorm, 1));
+		for(int h=0; h<numHyp; h++)
+		{
+			const float *vp = v + 3*h;
+			__m256 di = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(vp[0]), lx),
+								_mm256_mul_ps(_mm256_set1_ps(vp[1]), ly)),
+						  _mm256_mul_ps(_mm256_set1_ps(vp[2]), lz));
+			// the norm product is done in double like the scalar code
+			__m256d vn = _mm256_set1_pd(vNorm[h]);
+			__m256 den = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm256_cvtpd_ps(_mm256_mul_pd(vn, lNormLo))),
+							  _mm256_cvtpd_ps(_mm256_mul_pd(vn, lNormHi)), 1);
+			di = _mm256_div_ps(di, den);
+			_mm256_storeu_ps(E + h*n + i, _mm256_mul_ps(di, di));
+		}
+	}
+	residualsLSScalar(data, i, v, vNorm, numHyp, E);
+}
+
+__attribute__((target("avx2")))
+static void residualsNietoAVX2(const msacResidualData &data, int begin, const float *v, const double *vNorm, int numHyp, float *E)
+{
+	int n = data.numLines;
+	int i = begin;
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 signMask = _mm256_set1_ps(-0.0f);
+	for(; i+8<=n; i+=8)
+	{
+		__m256 l0 = _mm256_loadu_ps(data.lx + i);
+		__m256 negL1 = _mm256_xor_ps(_mm256_loadu_ps(data.ly + i), signMask);
+		__m256 nNorm = _mm256_loadu_ps(data.nNorm + i);
+		__m256 c0 = _mm256_loadu_ps(data.mx + i);
+		__m256 c1 = _mm256_loadu_ps(data.my + i);
+		__m256 nNormZero = _mm256_cmp_ps(nNorm, zero, _CMP_EQ_OQ);
+		for(int h=0; h<numHyp; h++)
+		{
+			const float *vp = v + 3*h;
+			__m256 v0 = _mm256_set1_ps(vp[0]);
+			__m256 v1 = _mm256_set1_ps(vp[1]);
+			__m256 v2 = _mm256_set1_ps(vp[2]);
+			__m256 r0 = _mm256_sub_ps(v1, _mm256_mul_ps(v2, c1));
+			__m256 r1 = _mm256_sub_ps(_mm256_mul_ps(v2, c0), v0);
+			__m256 rNorm = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(r0, r0), _mm256_mul_ps(r1, r1)));
+			__m256 num = _mm256_add_ps(_mm256_mul_ps(r0, negL1), _mm256_mul_ps(r1, l0));
+			num = _mm256_andnot_ps(signMask, num);
+			__m256 di = _mm256_div_ps(num, _mm256_mul_ps(nNorm, rNorm));
+			// d = 0 if one of the norms is 0
+			__m256 invalid = _mm256_or_ps(nNormZero, _mm256_cmp_ps(rNorm, zero, _CMP_EQ_OQ));
+			di = _mm256_andnot_ps(invalid, di);
+			_mm256_storeu_ps(E + h*n + i, _mm256_mul_ps(di, di));
+		}
+	}
+	residualsNietoScalar(data, i, v, vNorm, numHyp, E);
+}
+#endif
+
+msacResidualsFunc selectResidualsLS()
+{
+#ifdef MSAC_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) return residualsLSAVX2;
+#endif
+	return residualsLSScalar;
+}
+
+msacResidualsFunc selectResidualsNieto()
+{
+#ifdef MSAC_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) return residualsNietoAVX2;
+#endif
+	return residualsNietoScalar;
+}
@@ -0,0 +1,49 @@
+#ifndef __MSACRESIDUALS_H__
+#define __MSACRESIDUALS_H__
+
+#include <math.h>
+
+/** The line segments of the residual kernels, stored as structure of arrays with one entry per line segment:
+	the general form li=[lx;ly;lz], the middle point [mx;my;1], the norm of li (MODE_LS) and the norm of
+	the 2D normal [-ly;lx] (MODE_NIETO)*/
+struct msacResidualData
+{
+	const float *lx, *ly, *lz;
+	const float *mx, *my;
+	const float *lNorm, *nNorm;
+	int numLines;
+};
+
+/** Computes E[h*numLines + i], the squared residual of the line segment i for the hypothesis h, for the line
+	segments [begin, numLines) and the hypotheses [0, numHyp). v holds the hypotheses (x,y,z) and vNorm their
+	norms, which only MODE_LS uses*/
+typedef void (*msacResidualsFunc)(const msacResidualData &data, int begin, const float *v, const double *vNorm, int numHyp, float *E);
+
+/** The distance of Nieto, see errorNIETO.h, on plain floats for a line segment [l0;l1;l2] with the norm nNorm
+	of its normal [-l1;l0] and the mid point [c0;c1;1]. The vanishing point must be uncalibrated and in
+	Cartesian coordinates. */
+inline float distanceNieto( const float vanishingPoint[3], float l0, float l1, float nNorm, float c0, float c1 )
+{
+	float r0 = vanishingPoint[1] - vanishingPoint[2]*c1;
+	float r1 = vanishingPoint[2]*c0 - vanishingPoint[0];
+	float rNorm = sqrt(r0*r0 + r1*r1);
+
+	float num = r0*(-l1) + r1*l0;
+	if( num < 0 )
+		num = -num;
+
+	float d = 0;
+	if(nNorm != 0 && rNorm != 0)
+		d = num/(nNorm*rNorm);
+
+	return d;
+}
+
+/** Returns the kernel of the LS residuals, v being calibrated. The AVX2 kernel is picked if the cpu
+	supports it, msacResidualsTest checks that it matches the scalar one*/
+msacResidualsFunc selectResidualsLS();
+
+/** Returns the kernel of the Nieto residuals, v being uncalibrated, like selectResidualsLS*/
+msacResidualsFunc selectResidualsNieto();
+
+#endif // __MSACRESIDUALS_H__
@@ -0,0 +1,162 @@
+/**
+ * checks that the AVX2 residual kernels of MSAC are bit-identical to the scalar ones, on random
+ * line segments whose number is not always a multiple of 8, with null normals and hypotheses on
+ * the middle points of the line segments.
+ *
+ * The kernels are static, so msacResiduals.cpp is compiled into this test.
+ */
+#include "msacResiduals.cpp"
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+#define TEST_MAX_HYPOTHESES	(16)
+#define TEST_GUARD	(16)	// floats after E that no kernel may write
+#define TEST_GUARD_VALUE	(-12345.0f)
+
+static unsigned int testRandom(unsigned int& state)
+{
+	state = state * 1664525u + 1013904223u;
+	return state >> 8;
+}
+
+static float randomFloat(unsigned int& state, float from, float to)
+{
+	return from + (to - from) * (float)testRandom(state) / (float)(1u << 24);
+}
+
+/**
+ * the line segments of a 640x480 image, stored like MSAC::setLineSegment. One in 8 is a point,
+ * its normal is null, the kernels must give the residual 0 (Nieto) or the same NaN (LS).
+ */
+struct TestLines
+{
+	std::vector<float> lx, ly, lz, mx, my, lNorm, nNorm;
+
+	void generate(int n, unsigned int& state)
+	{
+		lx.resize(n); ly.resize(n); lz.resize(n);
+		mx.resize(n); my.resize(n);
+		lNorm.resize(n); nNorm.resize(n);
+		for (int i = 0; i < n; ++i) {
+			float x1 = randomFloat(state, 0, 640), y1 = randomFloat(state, 0, 480);
+			float x2 = x1, y2 = y1;
+			if (testRandom(state) % 8 != 0) {
+				x2 = randomFloat(state, 0, 640);
+				y2 = randomFloat(state, 0, 480);
+			}
+			lx[i] = y1 - y2;
+			ly[i] = x2 - x1;
+			lz[i] = x1 * y2 - y1 * x2;
+			mx[i] = (x1 + x2) / 2;
+			my[i] = (y1 + y2) / 2;
+			lNorm[i] = (float)sqrt((double)lx[i] * lx[i] + (double)ly[i] * ly[i] + (double)lz[i] * lz[i]);
+			nNorm[i] = sqrt(lx[i] * lx[i] + ly[i] * ly[i]);
+		}
+	}
+
+	msacResidualData data() const
+	{
+		msacResidualData d;
+		d.lx = &lx[0]; d.ly = &ly[0]; d.lz = &lz[0];
+		d.mx = &mx[0]; d.my = &my[0];
+		d.lNorm = &lNorm[0]; d.nNorm = &nNorm[0];
+		d.numLines = (int)lx.size();
+		return d;
+	}
+};
+
+/**
+ * the hypotheses of MODE_LS are calibrated and normalized, the ones of MODE_NIETO are image points,
+ * some of them at the infinity and some on the middle point of a line segment (the null residual).
+ */
+static void randomHypotheses(bool nieto, const TestLines& lines, int numHyp, unsigned int& state,
+			     float* v, double* vNorm)
+{
+	for (int h = 0; h < numHyp; ++h) {
+		float* vp = v + 3 * h;
+		unsigned int kind = testRandom(state) % 4;
+		if (nieto && kind == 0) {
+			int i = (int)(testRandom(state) % lines.mx.size());
+			vp[0] = lines.mx[i]; vp[1] = lines.my[i]; vp[2] = 1;
+		}
+		else if (nieto) {
+			vp[0] = randomFloat(state, -2000, 2000);
+			vp[1] = randomFloat(state, -2000, 2000);
+			vp[2] = kind == 1 ? 0 : 1;
+		}
+		else {
+			vp[0] = randomFloat(state, -1, 1);
+			vp[1] = randomFloat(state, -1, 1);
+			vp[2] = randomFloat(state, -1, 1);
+		}
+		vNorm[h] = sqrt((double)vp[0] * vp[0] + (double)vp[1] * vp[1] + (double)vp[2] * vp[2]);
+		if (!nieto && vNorm[h] > 0) {
+			for (int k = 0; k < 3; ++k) vp[k] = (float)(vp[k] / vNorm[h]);
+			vNorm[h] = sqrt((double)vp[0] * vp[0] + (double)vp[1] * vp[1] + (double)vp[2] * vp[2]);
+		}
+	}
+}
+
+/**
+ * @return the number of cases whose residuals differ from the ones of the scalar kernel
+ */
+static int checkKernel(const char* name, bool nieto, msacResidualsFunc residuals, msacResidualsFunc reference)
+{
+	const int numHyps[] = {1, 2, 3, 7, 8, TEST_MAX_HYPOTHESES};
+	const int numNumHyps = sizeof(numHyps) / sizeof(numHyps[0]);
+	unsigned int state = 12345;
+	int failures = 0, cases = 0;
+	TestLines lines;
+	float v[3 * TEST_MAX_HYPOTHESES];
+	double vNorm[TEST_MAX_HYPOTHESES];
+
+	for (int n = 1; n <= 1000; n += (n < 70 ? 1 : 53)) {
+		lines.generate(n, state);
+		msacResidualData data = lines.data();
+		std::vector<float> E(TEST_MAX_HYPOTHESES * n + TEST_GUARD), expected(E.size());
+		for (int k = 0; k < numNumHyps; ++k) {
+			int numHyp = numHyps[k];
+			int begins[] = {0, n / 3, n - 1};
+			for (int b = 0; b < 3; ++b) {
+				randomHypotheses(nieto, lines, numHyp, state, v, vNorm);
+				std::fill(E.begin(), E.end(), TEST_GUARD_VALUE);
+				std::fill(expected.begin(), expected.end(), TEST_GUARD_VALUE);
+				reference(data, begins[b], v, vNorm, numHyp, &expected[0]);
+				residuals(data, begins[b], v, vNorm, numHyp, &E[0]);
+				++cases;
+
+				// the NaN of a null line segment in MODE_LS are compared by their bits too
+				if (std::memcmp(&E[0], &expected[0], E.size() * sizeof(float)) != 0) {
+					if (failures < 10)
+						printf("%s: mismatch for numLines = %d, numHyp = %d, begin = %d\n",
+						       name, n, numHyp, begins[b]);
+					++failures;
+				}
+			}
+		}
+	}
+	printf("%s: %d cases, %d mismatches\n", name, cases, failures);
+	return failures;
+}
+
+int main()
+{
+	int failures = 0;
+	failures += checkKernel("LS dispatch", false, selectResidualsLS(), residualsLSScalar);
+	failures += checkKernel("Nieto dispatch", true, selectResidualsNieto(), residualsNietoScalar);
+#ifdef MSAC_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		failures += checkKernel("LS avx2", false, residualsLSAVX2, residualsLSScalar);
+		failures += checkKernel("Nieto avx2", true, residualsNietoAVX2, residualsNietoScalar);
+	}
+	else printf("avx2: not supported by the cpu, skipped\n");
+#else
+	printf("avx2: not an x86 build, skipped\n");
+#endif
+
+	printf(failures == 0 ? "PASSED\n" : "FAILED\n");
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,156 @@
+#include "ridgeFilter.h"
+#include <cstring>
+#include <cstdlib>
+#include <cfloat>
+#include <cmath>
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RIDGE_FILTER_X86
+#include <immintrin.h>
+#endif
+
+namespace gentech
+{
+
+static const double RIDGE_PI = 3.14159265358979323846;
+
+typedef void (*ridgeFilterRowFunc)(const unsigned char*, unsigned char*, int, int);
+
+/**
+ * the reference implementation, one pixel at a time.
+ */
+static void ridgeFilterRowScalar(const unsigned char* src, unsigned char* dst, int cols, int w)
+{
+	for (int c = w; c < cols - w; ++c) {
+		int tmp = 0;
+		if (src[c] != 0) {
+			tmp += 2 * src[c];
+			tmp -= src[c - w];
+			tmp -= src[c + w];
+			tmp -= std::abs((int)(src[c - w] - src[c + w]));
+			dst[c] = tmp < 0 ? 0 : (tmp > 255 ? 255 : (unsigned char)tmp);
+		}
+	}
+}
+
+#ifdef RIDGE_FILTER_X86
+/*
+ * 2*p - a - b - |a - b| equals 2*(p - max(a, b)), so the filter can be done on unsigned bytes:
+ * d = subs(p, max(a, b)) clamps the negative responses (and p == 0) to 0,
+ * adds(d, d) clamps the doubled response to 255.
+ */
+__attribute__((target("sse2")))
+static void ridgeFilterRowSSE2(const unsigned char* src, unsigned char* dst, int cols, int w)
+{
+	int c = w;
+	for (; c + 16 <= cols - w; c += 16) {
+		__m128i p = _mm_loadu_si128((const __m128i*)(src + c));
+		__m128i a = _mm_loadu_si128((const __m128i*)(src + c - w));
+		__m128i b = _mm_loadu_si128((const __m128i*)(src + c + w));
+		__m128i d = _mm_subs_epu8(p, _mm_max_epu8(a, b));
+		_mm_storeu_si128((__m128i*)(dst + c), _mm_adds_epu8(d, d));
+	}
+	ridgeFilterRowScalar(src + c - w, dst + c - w, cols - c + w, w);
+}
+
+__attribute__((target("avx2")))
+static void ridgeFilterRowAVX2(const unsigned char* src, unsigned char* dst, int cols, int w)
+{
+	int c = w;
+	for (; c + 32 <= cols - w; c += 32) {
+		__m256i p = _mm256_loadu_si256((const __m256i*)(src + c));
+		__m256i a = _mm256_loadu_si256((const __m256i*)(src + c - w));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(src + c + w));
+		__m256i d = _mm256_subs_epu8(p, _mm256_max_epu8(a, b));
+		_mm256_storeu_si256((__m256i*)(dst + c), _mm256_adds_epu8(d, d));
+	}
+	ridgeFilterRowSSE2(src + c - w, dst + c - w, cols - c + w, w);
+}
+#endif
+
+static ridgeFilterRowFunc selectRidgeFilterRow()
+{
+#ifdef RIDGE_FILTER_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) return ridgeFilterRowAVX2;
+	if (__builtin_cpu_supports("sse2")) return ridgeFilterRowSSE2;
+#endif
+	return ridgeFilterRowScalar;
+}
+
+void ridgeFilterRow(const unsigned char* src, unsigned char* dst, int cols, int laneMarkingWidth)
+{
+	static const ridgeFilterRowFunc filterRow = selectRidgeFilterRow();
+
+	std::memset(dst, 0, cols);
+	if (cols <= 2 * laneMarkingWidth) return;
+	filterRow(src, dst, cols, laneMarkingWidth);
+}
+
+void ridgeOrientationRow(const unsigned char* const* rows, const unsigned char* response,
+			 unsigned char* orientation, int cols, int laneMarkingWidth)
+{
+	const int numDirections = 16;
+	int w = laneMarkingWidth;
+	int dx[numDirections], dy[numDirections];
+	double cos2[numDirections], sin2[numDirections];
+	for (int k = 0; k < numDirections; ++k) {
+		double t = k * RIDGE_PI / numDirections;
+		dx[k] = (int)floor(w * cos(t) + 0.5);
+		dy[k] = (int)floor(w * sin(t) + 0.5);
+		// the rounded offset is not exactly at the angle t
+		double a = 2 * atan2((double)dy[k], (double)dx[k]);
+		cos2[k] = cos(a);
+		sin2[k] = sin(a);
+	}
+
+	std::memset(orientation, RIDGE_NO_ORIENTATION, cols);
+	for (int c = w; c < cols - w; ++c) {
+		if (response[c] == 0) continue;
+		// the second harmonic of the gray values on the circle of radius w,
+		// it points along the bright line through the center
+		double a = 0, b = 0;
+		for (int k = 0; k < numDirections; ++k) {
+			int s = rows[w + dy[k]][c + dx[k]] + rows[w - dy[k]][c - dx[k]];
+			a += s * cos2[k];
+			b += s * sin2[k];
+		}
+		if (a == 0 && b == 0) continue;
+
+		// the normal of the line is 90 degrees away
+		double phi = 0.5 * atan2(b, a);
+		int theta = (int)floor(phi * 180 / RIDGE_PI + 90 + 0.5);
+		orientation[c] = (unsigned char)((theta + 180) % 180);
+	}
+}
+
+int getOtsuThreshold(const int hist[256], int total)
+{
+	if (total <= 0) return 0;
+
+	double mu = 0, scale = 1.0 / total;
+	for (int i = 0; i < 256; ++i) mu += i * (double)hist[i];
+	mu *= scale;
+
+	double mu1 = 0, q1 = 0;
+	double maxSigma = 0;
+	int maxVal = 0;
+	for (int i = 0; i < 256; ++i) {
+		double p_i = hist[i] * scale;
+		mu1 *= q1;
+		q1 += p_i;
+		double q2 = 1.0 - q1;
+		if (std::min(q1, q2) < FLT_EPSILON || std::max(q1, q2) > 1.0 - FLT_EPSILON) continue;
+		mu1 = (mu1 + i * p_i) / q1;
+		double mu2 = (mu - q1 * mu1) / q2;
+		double sigma = q1 * q2 * (mu1 - mu2) * (mu1 - mu2);
+		if (sigma > maxSigma) {
+			maxSigma = sigma;
+			maxVal = i;
+		}
+	}
+	return maxVal;
+}
+
+}
@@ -0,0 +1,59 @@
+#ifndef _RIDGE_FILTER_H_
+#define _RIDGE_FILTER_H_
+
+namespace gentech
+{
+
+/** the orientation of the pixels without line response */
+#define RIDGE_NO_ORIENTATION (255)
+
+/**
+ * outstand the bright line markings in one row of a gray image.
+ *
+ * dst[c] = saturate(2*src[c] - src[c-w] - src[c+w] - |src[c-w] - src[c+w]|) for c in [w, cols - w)
+ * and src[c] != 0, all the other pixels of dst are set to 0.
+ * The SSE2 or AVX2 kernel is picked at runtime if the cpu supports it,
+ * its output is bit-identical to the scalar loop.
+ *
+ * @param[in] src the gray row
+ * @param[out] dst the filtered row, should not overlap src
+ * @param[in] cols the number of pixels in the row
+ * @param[in] laneMarkingWidth the width w of the line marking in the road
+ */
+void ridgeFilterRow(const unsigned char* src, unsigned char* dst, int cols, int laneMarkingWidth);
+
+/**
+ * the orientation of the line markings in one row of a gray image.
+ *
+ * The gray values on a circle of radius laneMarkingWidth around the pixel are brightest
+ * along the line marking, the angle of their second harmonic gives the line direction.
+ * A point gradient is no use here, it vanishes in the middle of a marking where the
+ * ridge response is the largest. The orientation is the theta bin (0 - 179, in degrees)
+ * of the line normal, as used by the hough transform rho = x * cos(theta) + y * sin(theta).
+ *
+ * @param[in] rows the 2 * laneMarkingWidth + 1 gray rows centered at the row,
+ *                 rows[laneMarkingWidth] is the row itself; rows beyond the image border
+ *                 should point to the nearest row inside
+ * @param[in] response the output of ridgeFilterRow for the row, the orientation is only
+ *                     computed where it is not 0
+ * @param[out] orientation the theta bin of every pixel, RIDGE_NO_ORIENTATION if unknown
+ * @param[in] cols the number of pixels in the row
+ * @param[in] laneMarkingWidth the width of the line marking in the road
+ */
+void ridgeOrientationRow(const unsigned char* const* rows, const unsigned char* response,
+			 unsigned char* orientation, int cols, int laneMarkingWidth);
+
+/**
+ * get the Otsu threshold from a 256 bins gray histogram,
+ * the same value cv::threshold(..., CV_THRESH_OTSU) computes from the image.
+ *
+ * @param[in] hist the histogram of the image
+ * @param[in] total the number of pixels counted in hist
+ *
+ * @return the threshold, pixels larger than it belong to the foreground
+ */
+int getOtsuThreshold(const int hist[256], int total);
+
+}
+
+#endif /* _RIDGE_FILTER_H_ */
@@ -0,0 +1,129 @@
+/**
+ * checks that the SIMD kernels of the ridge filter are bit-identical to the original loop
+ * of getLineCandidatesImg, on random rows of many lengths and marking widths.
+ *
+ * The kernels are static, so ridgeFilter.cpp is compiled into this test.
+ */
+#include "ridgeFilter.cpp"
+#include <cstdio>
+#include <vector>
+
+using namespace gentech;
+
+#define TEST_GUARD	(64)	// bytes after the row that no kernel may write
+#define TEST_GUARD_VALUE	(0xA5)
+
+/**
+ * the loop of getLineCandidatesImg before the vectorization, dst is cleared first.
+ */
+static void referenceRow(const unsigned char* src, unsigned char* dst, int cols, int w)
+{
+	std::memset(dst, 0, cols);
+	for (int c = w; c < cols - w; ++c) {
+		int tmp = 0;
+		if (src[c] != 0) {
+			tmp += 2 * src[c];
+			tmp -= src[c - w];
+			tmp -= src[c + w];
+			tmp -= std::abs((int)(src[c - w] - src[c + w]));
+			dst[c] = tmp < 0 ? 0 : (tmp > 255 ? 255 : (unsigned char)tmp);
+		}
+	}
+}
+
+static unsigned int testRandom(unsigned int& state)
+{
+	state = state * 1664525u + 1013904223u;
+	return state >> 24;
+}
+
+/**
+ * the rows mix dark road (often exactly 0, which the filter skips), bright markings and noise.
+ */
+static void randomRow(unsigned char* src, int cols, unsigned int& state)
+{
+	for (int c = 0; c < cols; ++c) {
+		unsigned int r = testRandom(state);
+		if (r < 64) src[c] = 0;
+		else if (r < 96) src[c] = 255;
+		else src[c] = (unsigned char)testRandom(state);
+	}
+}
+
+/**
+ * @return the number of rows whose output differs from referenceRow
+ */
+static int checkKernel(const char* name, ridgeFilterRowFunc filterRow)
+{
+	const int widths[] = {1, 2, 3, 5, 10, 17, 33};
+	const int numWidths = sizeof(widths) / sizeof(widths[0]);
+	std::vector<unsigned char> src(1024 + TEST_GUARD), expected(1024), dst(1024 + TEST_GUARD);
+	unsigned int state = 12345;
+	int failures = 0, rows = 0;
+
+	for (int k = 0; k < numWidths; ++k) {
+		int w = widths[k];
+		for (int cols = 2 * w + 1; cols <= 1000; cols += (cols < 100 ? 1 : 37)) {
+			for (int repeat = 0; repeat < 4; ++repeat) {
+				randomRow(&src[0], cols + TEST_GUARD, state);
+				referenceRow(&src[0], &expected[0], cols, w);
+				std::memset(&dst[0], 0, cols);
+				std::memset(&dst[cols], TEST_GUARD_VALUE, TEST_GUARD);
+				filterRow(&src[0], &dst[0], cols, w);
+				++rows;
+
+				bool ok = std::memcmp(&dst[0], &expected[0], cols) == 0;
+				for (int g = 0; g < TEST_GUARD; ++g) ok = ok && dst[cols + g] == TEST_GUARD_VALUE;
+				if (!ok) {
+					if (failures < 10) printf("%s: mismatch for cols = %d, w = %d\n", name, cols, w);
+					++failures;
+				}
+			}
+		}
+	}
+	printf("%s: %d rows, %d mismatches\n", name, rows, failures);
+	return failures;
+}
+
+/**
+ * ridgeFilterRow also clears the rows too short for the filter.
+ */
+static int checkDispatch()
+{
+	unsigned char src[64], dst[64], expected[64];
+	unsigned int state = 777;
+	int failures = 0;
+	for (int w = 1; w <= 20; ++w) {
+		for (int cols = 1; cols <= 64; ++cols) {
+			randomRow(src, cols, state);
+			referenceRow(src, expected, cols, w);
+			std::memset(dst, TEST_GUARD_VALUE, cols);
+			ridgeFilterRow(src, dst, cols, w);
+			if (std::memcmp(dst, expected, cols) != 0) {
+				if (failures < 10) printf("ridgeFilterRow: mismatch for cols = %d, w = %d\n", cols, w);
+				++failures;
+			}
+		}
+	}
+	printf("ridgeFilterRow: %d mismatches\n", failures);
+	return failures;
+}
+
+int main()
+{
+	int failures = 0;
+	failures += checkKernel("scalar", ridgeFilterRowScalar);
+#ifdef RIDGE_FILTER_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) failures += checkKernel("sse2", ridgeFilterRowSSE2);
+	else printf("sse2: not supported by the cpu, skipped\n");
+	if (__builtin_cpu_supports("avx2")) failures += checkKernel("avx2", ridgeFilterRowAVX2);
+	else printf("avx2: not supported by the cpu, skipped\n");
+#else
+	printf("sse2, avx2: not an x86 build, skipped\n");
+#endif
+	failures += checkDispatch();
+
+	printf(failures == 0 ? "PASSED\n" : "FAILED\n");
+	return failures == 0 ? 0 : 1;
+}
@@ -1,20 +1,10 @@
-#include "MSAC.h"
 #include "roadRoiExtract.h"
+#include "ridgeFilter.h"
 #include <iostream>
 
 namespace gentech
 {
 
-/**
- * used internal for finding the left and right lane.
- */ 
-struct laneDetectorLine
-{
-	cv::Point top;
-	cv::Point bottom;
-	double angle;
-};
-
 bool laneDetectorLineCompare(const struct laneDetectorLine& a, 
 		             const struct laneDetectorLine& b)
 {
@@ -24,66 +14,107 @@ bool laneDetectorLineCompare(const struct laneDetectorLine& a,
 /**
  * outstand the underlying lines in the road image.
  *
+ * The gray conversion, the line filter and the histogram of the Otsu threshold are done
+ * row by row in a single pass, only the binarization reads dstGray a second time.
+ *
  * @param[in] srcImg original road image
  * @param[in, out] dstGray the gray image, which outstand the underlying lines in the road image
  * @param[in] lineMarkingWidth the width of the line marking in the road, 
                                which depends on the actual image
+ * @param[in] horizonRow the rows above it are set to 0 and not counted in the threshold
+ * @param[out] orientationImg optional, the line orientation of every pixel, see ridgeOrientationRow
  */
-void getLineCandidatesImg(const cv::Mat& srcImg, cv::Mat& dstGray, int laneMarkingWidth = 10)
+void LaneDetector::getLineCandidatesImg(const cv::Mat& srcImg, cv::Mat& dstGray, int laneMarkingWidth, int horizonRow,
+					cv::Mat* orientationImg)
 {
-	cv::Mat srcGray;
-	if (srcImg.channels() == 3) cv::cvtColor(srcImg, srcGray, CV_BGR2GRAY);
-	else srcImg.copyTo(srcGray);
-
- 	dstGray.create(srcGray.size(), srcGray.type());
-	dstGray.setTo(0);
-
-	for (int r = 0; r < srcGray.rows; ++r) {
-		unsigned char* pRowSrc = srcGray.ptr<unsigned char>(r);
+	CV_Assert(srcImg.channels() == 3 || srcImg.channels() == 1);
+
+	dstGray.create(srcImg.size(), CV_8UC1);
+	horizonRow = std::max(0, std::min(horizonRow, srcImg.rows - 1));
+	dstGray.rowRange(0, horizonRow).setTo(0);
+
+	// the filter is horizontal, so one gray row is all the color image needs,
+	// the orientation also needs the rows within laneMarkingWidth, they are kept in a ring
+	int radius = 0;
+	if (orientationImg != NULL) {
+		orientationImg->create(srcImg.size(), CV_8UC1);
+		orientationImg->rowRange(0, horizonRow).setTo(RIDGE_NO_ORIENTATION);
+		radius = laneMarkingWidth;
+		m_grayRowPtrs.resize(2 * radius + 1);
+	}
+	int ringRows = 2 * radius + 1;
+	bool isColor = srcImg.channels() == 3;
+	if (isColor) m_grayRows.create(ringRows, srcImg.cols, CV_8UC1);
+
+	int hist[256] = {0};
+	int lastConverted = -1;
+	for (int r = horizonRow; r < srcImg.rows; ++r) {
+		if (isColor) {
+			int last = std::min(r + radius, srcImg.rows - 1);
+			for (int y = std::max(lastConverted + 1, r - radius); y <= last; ++y) {
+				if (y < 0) continue;
+				cv::Mat slot = m_grayRows.row(y % ringRows);
+				cv::cvtColor(srcImg.row(y), slot, CV_BGR2GRAY);
+			}
+			lastConverted = last;
+		}
+		const unsigned char* pRowSrc = isColor ? m_grayRows.ptr<unsigned char>(r % ringRows) : srcImg.ptr<unsigned char>(r);
 		unsigned char* pRowDst = dstGray.ptr<unsigned char>(r);
-		for (int c = laneMarkingWidth; c < dstGray.cols - laneMarkingWidth; ++c) {
-			int tmp = 0;
-			if (pRowSrc[c] != 0) {
-				tmp += 2 * pRowSrc[c];
-				tmp -= pRowSrc[c - laneMarkingWidth];
-				tmp -= pRowSrc[c + laneMarkingWidth];
-				tmp -= std::abs((int)(pRowSrc[c - laneMarkingWidth] - pRowSrc[c + laneMarkingWidth]));
-				pRowDst[c] = cv::saturate_cast<unsigned char>(tmp);
+		ridgeFilterRow(pRowSrc, pRowDst, dstGray.cols, laneMarkingWidth);
+		for (int c = 0; c < dstGray.cols; ++c) ++hist[pRowDst[c]];
+
+		if (orientationImg != NULL) {
+			for (int k = 0; k < ringRows; ++k) {
+				int y = std::max(0, std::min(r - radius + k, srcImg.rows - 1));
+				m_grayRowPtrs[k] = isColor ? m_grayRows.ptr<unsigned char>(y % ringRows) : srcImg.ptr<unsigned char>(y);
 			}
+			ridgeOrientationRow(&m_grayRowPtrs[0], pRowDst, orientationImg->ptr<unsigned char>(r),
+					    dstGray.cols, laneMarkingWidth);
 		}
 	}
-	
-	cv::threshold(dstGray, dstGray, 0, 255, CV_THRESH_OTSU);
+
+	int otsuThreshold = getOtsuThreshold(hist, (dstGray.rows - horizonRow) * dstGray.cols);
+	cv::Mat window = dstGray.rowRange(horizonRow, dstGray.rows);
+	cv::threshold(window, window, otsuThreshold, 255, CV_THRESH_BINARY);
 }
 
 /**
- * detect the lines in the image by hough transform.
+ * detect the line segments in the line candidates image by the selected segment detector.
  *
- * @param[in] img the input image
+ * @param[in, out] img the line candidates image, the pixels of the detected lines may be cleared
  * @param[in, out] lines the detected lines in the image
+ * @param[in] horizonRow only the rows below it are searched
+ * @param[in] pyramidLevel img is downscaled by 2^pyramidLevel, the length thresholds are scaled with it
+ * @param[in] orientationImg the line orientation of the pixels of img if the segment detector needs it
  */
 #define MAX_NUM_LINES (200)
-void lineDetector(cv::Mat& img, std::vector<cv::Vec4i>& lines)
+void LaneDetector::lineDetector(cv::Mat& img, std::vector<cv::Vec4i>& lines, int horizonRow, int pyramidLevel,
+				const cv::Mat* orientationImg)
 {
 	CV_Assert(img.channels() == 1);
 
-	int houghThreshold = 70;
-	std::vector<cv::Vec4i> linesTmp;
-	cv::HoughLinesP(img, linesTmp, 1, CV_PI/180, houghThreshold, 20, 10);
-	while (linesTmp.size() > MAX_NUM_LINES) {
-		houghThreshold += 10;
-		linesTmp.clear();
-		cv::HoughLinesP(img, linesTmp, 1, CV_PI/180, houghThreshold, 20, 10);
-	}
+	horizonRow = std::max(0, std::min(horizonRow, img.rows - 1));
+	cv::Mat window = img.rowRange(horizonRow, img.rows);
+	cv::Mat orientationWindow;
+	if (orientationImg != NULL) orientationWindow = orientationImg->rowRange(horizonRow, img.rows);
+
+	int minHeight = 10 >> pyramidLevel;
+	int minWidth = std::max(5 >> pyramidLevel, 1);
+	std::vector<cv::Vec4i>& linesTmp = m_linesTmp;
+	segmentDetector().detect(window, orientationImg != NULL ? &orientationWindow : NULL, linesTmp,
+				 MAX_NUM_LINES, pyramidLevel);
 	
 	lines.clear();
 	for (std::size_t i = 0; i < linesTmp.size(); ++i) {
+		// back to the coordinates of the full image
+		linesTmp[i][1] += horizonRow;
+		linesTmp[i][3] += horizonRow;
 		// remove too horizontal lines
-		if (std::abs(linesTmp[i][1] - linesTmp[i][3]) < 10) continue;
+		if (std::abs(linesTmp[i][1] - linesTmp[i][3]) < minHeight) continue;
 		// remove too vertical lines, the middle line would be detected in the following procedure,
 		// it does not matter if the middle line is removed by this process.
 		// the left or right lanes may be too vertical in some situations, so threshold value is 5 not 10.
-		if (std::abs(linesTmp[i][0] - linesTmp[i][2]) < 5) continue;
+		if (std::abs(linesTmp[i][0] - linesTmp[i][2]) < minWidth) continue;
 		lines.push_back(linesTmp[i]);
 	}
 }
@@ -102,24 +133,46 @@ void lineDetector(cv::Mat& img, std::vector<cv::Vec4i>& lines)
  * note:
  * if return 0, the data in the lineFiltered should not be used.
  */ 
-int lineFilter(std::vector<cv::Vec4i>& lines, 
-	       cv::Size imgSize,
-	       std::vector<struct laneDetectorLine>& lineFiltered) 
+int LaneDetector::lineFilter(std::vector<cv::Vec4i>& lines, 
+			     cv::Size imgSize,
+			     std::vector<struct laneDetectorLine>& lineFiltered) 
 {
 	// Call msac function for multiple vanishing point estimation
-	std::vector<std::vector<cv::Point> > lineSegments;
-	for (std::size_t i = 0; i < lines.size(); ++i) {
-		std::vector<cv::Point> aux;
-		aux.push_back(cv::Point(lines[i][0], lines[i][1]));
-		aux.push_back(cv::Point(lines[i][2], lines[i][3]));
-		lineSegments.push_back(aux);
+	std::vector<cv::Mat>& vps = m_vps;
+	std::vector<int>& numInliers = m_numInliers;
+	vps.clear();
+	numInliers.clear();
+	lineFiltered.clear();
+	if (imgSize != m_msacSize) {
+		m_msac.init(m_msacMode, imgSize, false, m_msacSeed);
+		m_msacFallback.init(MODE_BRANCH_AND_BOUND, imgSize, false, m_msacSeed);
+		m_msacSize = imgSize;
+	}
+	m_msac.multipleVPEstimation(lines, m_clusterIndices, m_clusterOffsets, numInliers, vps, 1); 
+
+	// a hard frame, the branch and bound finds the vanishing point with the most inliers instead of a retry.
+	// the budget is for the whole frame, so the branch and bound only gets what the first search left
+	m_vanishingPointStats = m_msac.getStats();
+	if (m_fallbackInlierRatio > 0 &&
+	    (vps.size() <= 0 || vps[0].at<float>(2, 0) == 0 || numInliers[0] < m_fallbackInlierRatio * lines.size())) {
+		int remainingIterations = m_budgetIterations - m_vanishingPointStats.iterations;
+		double remainingMilliseconds = m_budgetMilliseconds - m_vanishingPointStats.elapsedMs;
+		if ((m_budgetIterations > 0 && remainingIterations <= 0) || (m_budgetMilliseconds > 0 && remainingMilliseconds <= 0)) {
+			m_vanishingPointStats.truncated = true;
+		} else {
+			m_msacFallback.setBudget(m_budgetIterations > 0 ? remainingIterations : 0,
+						 m_budgetMilliseconds > 0 ? remainingMilliseconds : 0);
+			vps.clear();
+			numInliers.clear();
+			m_msacFallback.multipleVPEstimation(lines, m_clusterIndices, m_clusterOffsets, numInliers, vps, 1);
+
+			const MSACStats& fallbackStats = m_msacFallback.getStats();
+			m_vanishingPointStats.iterations += fallbackStats.iterations;
+			m_vanishingPointStats.elapsedMs += fallbackStats.elapsedMs;
+			m_vanishingPointStats.truncated = fallbackStats.truncated;
+			m_vanishingPointStats.optimal = fallbackStats.optimal;
+		}
 	}
-	std::vector<cv::Mat> vps;			
-	std::vector<int> numInliers;
-	std::vector<std::vector<std::vector<cv::Point> > > lineSegmentsClusters;
-	MSAC msac;
-	msac.init(MODE_NIETO, imgSize);
-	msac.multipleVPEstimation(lineSegments, lineSegmentsClusters, numInliers, vps, 1); 
 
 	if (vps.size() <= 0 || vps[0].at<float>(2, 0) == 0) return 0;
 
@@ -127,14 +180,14 @@ int lineFilter(std::vector<cv::Vec4i>& lines,
 	cv::Point vanishingPoint;
 	vanishingPoint.x = (int)vps[0].at<float>(0, 0);
 	vanishingPoint.y = (int)vps[0].at<float>(1, 0);
-	std::vector<std::vector<cv::Point> >& lineCluster = lineSegmentsClusters[0];
-	for (std::size_t i = 0; i < lineCluster.size(); ++i) {
+	for (int k = m_clusterOffsets[0]; k < m_clusterOffsets[1]; ++k) {
+		const cv::Vec4i& l = lines[m_clusterIndices[k]];
 		struct laneDetectorLine line;
 		line.top = vanishingPoint;
-		if (lineCluster[i][0].y > lineCluster[i][1].y)
-			line.bottom = lineCluster[i][0];
+		if (l[1] > l[3])
+			line.bottom = cv::Point(l[0], l[1]);
 		else
-			line.bottom = lineCluster[i][1];
+			line.bottom = cv::Point(l[2], l[3]);
 		line.angle = atan((line.top.y - line.bottom.y) * 1.0 / (line.top.x - line.bottom.x));
 		lineFiltered.push_back(line);
 	}
@@ -206,38 +259,348 @@ inline void lineConvert(struct laneDetectorLine& innerLine,
 	outerLine.m_bottom = innerLine.bottom;
 }
 
-bool getLeftAndRightLane(const cv::Mat& cameraImg, 
-		         struct lane& leftLane, 
-			 struct lane& rightLane)
+/**
+ * detect the left and right lane in the image, the lanes are not completed.
+ *
+ * @param[in] img the road image, which may be downscaled by 2^pyramidLevel
+ * @param[in, out] left the left lane
+ * @param[in, out] right the right lane
+ * @param[in] horizonRow the lanes are only searched in the rows below it
+ * @param[in] pyramidLevel the level of img in the image pyramid, the filter width and
+ *                         the hough line lengths are scaled with it
+ */
+bool LaneDetector::detectLeftAndRightLane(const cv::Mat& img,
+					  struct laneDetectorLine& left,
+					  struct laneDetectorLine& right,
+					  int horizonRow,
+					  int pyramidLevel)
 {
-	cv::Mat lineCandidateImg;
-	getLineCandidatesImg(cameraImg, lineCandidateImg);
+	cv::Mat& lineCandidateImg = m_lineCandidateImg;
+	cv::Mat* orientationImg = segmentDetector().needsOrientation() ? &m_orientationImg : NULL;
+	getLineCandidatesImg(img, lineCandidateImg, std::max(10 >> pyramidLevel, 1), horizonRow, orientationImg);
 
-	std::vector<cv::Vec4i> rawLines;
-	lineDetector(lineCandidateImg, rawLines);
+	std::vector<cv::Vec4i>& rawLines = m_rawLines;
+	lineDetector(lineCandidateImg, rawLines, horizonRow, pyramidLevel, orientationImg);
 	if (rawLines.size() < 3) return false;
+	if (m_mergeSegments) {
+		m_segmentMerger.setParams(2, (float)std::max(3 >> pyramidLevel, 1), (float)(10 >> pyramidLevel));
+		m_segmentMerger.merge(rawLines);
+	}
 
 	//cv::Mat tmp;
-	//cameraImg.copyTo(tmp);
+	//img.copyTo(tmp);
 	//for (std::size_t i = 0; i < rawLines.size(); ++i) {
 	//	cv::Point start(rawLines[i][0], rawLines[i][1]);
 	//	cv::Point end(rawLines[i][2], rawLines[i][3]);
 	//	cv::line(tmp, start, end, cv::Scalar(0, 255, 255), 2);
 	//}
 
-	std::vector<struct laneDetectorLine> lineFiltered;
-	if (lineFilter(rawLines, cameraImg.size(), lineFiltered) == 0) return false;
+	std::vector<struct laneDetectorLine>& lineFiltered = m_lineFiltered;
+	if (lineFilter(rawLines, img.size(), lineFiltered) == 0) return false;
 
 	//cv::Mat tmp;
-	//cameraImg.copyTo(tmp);
+	//img.copyTo(tmp);
 	//for (std::size_t i = 0; i < lineFiltered.size(); ++i) {
 	//	cv::Point start = lineFiltered[i].top;
 	//	cv::Point end = lineFiltered[i].bottom;
 	//	cv::line(tmp, start, end, cv::Scalar(0, 255, 255), 2);
 	//}
 	
-	struct laneDetectorLine left, right;
 	getLeftAndRightLane(lineFiltered, left, right);
+	return true;
+}
+
+// functions for the coarse to fine lane detection
+/**
+ * the x coordinate of the lane at row y.
+ */
+inline double laneX(const struct laneDetectorLine& la, int y)
+{
+	return la.top.x + (la.bottom.x - la.top.x) * (double)(y - la.top.y) / (la.bottom.y - la.top.y);
+}
+
+/**
+ * the gray value of the pixel, same weights as CV_BGR2GRAY.
+ */
+inline unsigned char grayPixel(const cv::Mat& img, int r, int c)
+{
+	if (img.channels() == 1) return img.ptr<unsigned char>(r)[c];
+	const unsigned char* p = img.ptr<unsigned char>(r) + 3 * c;
+	return (unsigned char)((p[0] * 1868 + p[1] * 9617 + p[2] * 4899 + (1 << 13)) >> 14);
+}
+
+/**
+ * fit a lane detected in the downscaled image again at full resolution.
+ * Only the pixels in a narrow band around the coarse lane are filtered and thresholded,
+ * the rows where the bands of the two lanes overlap (near the vanishing point) are skipped.
+ *
+ * @param[in] cameraImg the full resolution road image
+ * @param[in] coarse the coarse lane, in full resolution coordinates
+ * @param[in] other the other coarse lane
+ * @param[in] bandWidth the half width of the band around the coarse lane
+ * @param[in] startRow the first row of the band
+ * @param[in] laneMarkingWidth the width of the line marking at full resolution
+ * @param[in, out] fitted the line (vx, vy, x0, y0) fitted to the line candidates in the band
+ *
+ * @return false if there are too few line candidates in the band
+ */
+bool LaneDetector::refineLane(const cv::Mat& cameraImg,
+			      const struct laneDetectorLine& coarse,
+			      const struct laneDetectorLine& other,
+			      int bandWidth,
+			      int startRow,
+			      int laneMarkingWidth,
+			      cv::Vec4f& fitted)
+{
+	if (coarse.bottom.y == coarse.top.y || other.bottom.y == other.top.y) return false;
+
+	int w = laneMarkingWidth;
+	std::vector<unsigned char>& grayBuf = m_bandGray;
+	std::vector<unsigned char>& respBuf = m_bandResponse;
+	grayBuf.resize(2 * (bandWidth + w) + 1);
+	respBuf.resize(grayBuf.size());
+	std::vector<cv::Point>& candidates = m_bandCandidates;
+	std::vector<unsigned char>& responses = m_bandCandidateResponses;
+	candidates.clear();
+	responses.clear();
+	int hist[256] = {0};
+	int total = 0;
+	for (int y = std::max(startRow, 0); y < cameraImg.rows; ++y) {
+		int xc = cvRound(laneX(coarse, y));
+		int xo = cvRound(laneX(other, y));
+		if (std::abs(xc - xo) <= 2 * bandWidth + w) continue;
+		int x0 = std::max(xc - bandWidth, w);
+		int x1 = std::min(xc + bandWidth, cameraImg.cols - 1 - w);
+		if (x0 > x1) continue;
+
+		int len = x1 - x0 + 1 + 2 * w;
+		for (int k = 0; k < len; ++k) grayBuf[k] = grayPixel(cameraImg, y, x0 - w + k);
+		ridgeFilterRow(&grayBuf[0], &respBuf[0], len, w);
+		for (int k = w; k < len - w; ++k) {
+			++hist[respBuf[k]];
+			++total;
+			if (respBuf[k] == 0) continue;
+			candidates.push_back(cv::Point(x0 - w + k, y));
+			responses.push_back(respBuf[k]);
+		}
+	}
+
+	int otsuThreshold = getOtsuThreshold(hist, total);
+	std::vector<cv::Point>& points = m_bandPoints;
+	points.clear();
+	for (std::size_t i = 0; i < candidates.size(); ++i) {
+		if (responses[i] > otsuThreshold) points.push_back(candidates[i]);
+	}
+	if (points.size() < 10) return false;
+
+	cv::fitLine(points, fitted, CV_DIST_HUBER, 0, 0.01, 0.01);
+	return true;
+}
+
+/**
+ * intersection of the line (vx, vy, x0, y0) with the row y.
+ */
+inline cv::Point fittedLineAtRow(const cv::Vec4f& l, int y)
+{
+	return cv::Point(cvRound(l[2] + l[0] * (y - l[3]) / l[1]), y);
+}
+
+/**
+ * detect the left and right lane in the downscaled image, then refine them at full resolution.
+ */
+bool LaneDetector::detectLeftAndRightLanePyramid(const cv::Mat& cameraImg,
+						 struct laneDetectorLine& left,
+						 struct laneDetectorLine& right,
+						 int horizonRow,
+						 int pyramidLevel)
+{
+	int scale = 1 << pyramidLevel;
+	cv::Mat& smallImg = m_smallImg;
+	cv::resize(cameraImg, smallImg, cv::Size(cameraImg.cols / scale, cameraImg.rows / scale), 0, 0, cv::INTER_AREA);
+	if (!detectLeftAndRightLane(smallImg, left, right, horizonRow / scale, pyramidLevel)) return false;
+
+	// to full resolution, the center of the downscaled pixel
+	struct laneDetectorLine* coarse[2] = {&left, &right};
+	for (int i = 0; i < 2; ++i) {
+		coarse[i]->top = coarse[i]->top * scale + cv::Point((scale - 1) / 2, (scale - 1) / 2);
+		coarse[i]->bottom = coarse[i]->bottom * scale + cv::Point((scale - 1) / 2, (scale - 1) / 2);
+	}
+
+	// the error of the coarse lane is about 2 pixels of the downscaled image
+	int bandWidth = 4 * scale;
+	int startRow = std::max(horizonRow, left.top.y);
+	cv::Vec4f leftFitted, rightFitted;
+	bool leftRefined = refineLane(cameraImg, left, right, bandWidth, startRow, 10, leftFitted) && leftFitted[1] != 0;
+	bool rightRefined = refineLane(cameraImg, right, left, bandWidth, startRow, 10, rightFitted) && rightFitted[1] != 0;
+
+	// the new vanishing point is the intersection of the fitted lanes
+	if (leftRefined && rightRefined) {
+		double det = leftFitted[0] * rightFitted[1] - leftFitted[1] * rightFitted[0];
+		if (std::abs(det) >= 1e-6) {
+			double t = ((rightFitted[2] - leftFitted[2]) * rightFitted[1] - (rightFitted[3] - leftFitted[3]) * rightFitted[0]) / det;
+			cv::Point vanishingPoint(cvRound(leftFitted[2] + t * leftFitted[0]), cvRound(leftFitted[3] + t * leftFitted[1]));
+			if (vanishingPoint.y < cameraImg.rows - 1) {
+				left.top = right.top = vanishingPoint;
+				left.bottom = fittedLineAtRow(leftFitted, cameraImg.rows - 1);
+				right.bottom = fittedLineAtRow(rightFitted, cameraImg.rows - 1);
+				left.angle = atan((left.top.y - left.bottom.y) * 1.0 / (left.top.x - left.bottom.x));
+				right.angle = atan((right.top.y - right.bottom.y) * 1.0 / (right.top.x - right.bottom.x));
+				return true;
+			}
+		}
+	}
+
+	// without the intersection, each refined lane keeps the row of the coarse vanishing point
+	// and the other lane keeps the coarse result
+	const cv::Vec4f* fitted[2] = {&leftFitted, &rightFitted};
+	bool refined[2] = {leftRefined, rightRefined};
+	for (int i = 0; i < 2; ++i) {
+		if (!refined[i]) continue;
+		coarse[i]->top = fittedLineAtRow(*fitted[i], coarse[i]->top.y);
+		coarse[i]->bottom = fittedLineAtRow(*fitted[i], cameraImg.rows - 1);
+		coarse[i]->angle = atan((coarse[i]->top.y - coarse[i]->bottom.y) * 1.0 / (coarse[i]->top.x - coarse[i]->bottom.x));
+	}
+	return true;
+}
+
+LaneDetector::LaneDetector()
+	: m_horizonRow(0),
+	  m_pyramidLevel(0),
+	  m_trackHorizon(false),
+	  m_segmentDetectorMode(SEGMENT_DETECTOR_HOUGH),
+	  m_mergeSegments(false),
+	  m_hasLastVanishingPoint(false),
+	  m_msacSize(0, 0),
+	  m_msacMode(MODE_NIETO),
+	  m_msacSeed(MSAC_DEFAULT_SEED),
+	  m_fallbackInlierRatio(0),
+	  m_budgetIterations(0),
+	  m_budgetMilliseconds(0)
+{
+	m_vanishingPointStats = m_msac.getStats();
+}
+
+void LaneDetector::setHorizonRow(int horizonRow)
+{
+	m_horizonRow = horizonRow;
+}
+
+void LaneDetector::setHorizonTracking(bool enable)
+{
+	m_trackHorizon = enable;
+	m_hasLastVanishingPoint = false;
+}
+
+void LaneDetector::setOrientationRanges(const std::vector<cv::Vec2f>& ranges)
+{
+	m_houghSegmentDetector.setOrientationRanges(ranges);
+	m_regionSegmentDetector.setOrientationRanges(ranges);
+}
+
+void LaneDetector::setOrientationGuidedVoting(bool enable, int toleranceDegrees)
+{
+	m_houghSegmentDetector.setOrientationGuidedVoting(enable, toleranceDegrees);
+}
+
+void LaneDetector::setSegmentDetector(int mode)
+{
+	CV_Assert(mode == SEGMENT_DETECTOR_HOUGH || mode == SEGMENT_DETECTOR_REGION);
+	m_segmentDetectorMode = mode;
+}
+
+void LaneDetector::setSegmentMerging(bool enable)
+{
+	m_mergeSegments = enable;
+}
+
+void LaneDetector::setParallelVanishingPoint(bool enable)
+{
+	m_msac.setParallel(enable);
+}
+
+void LaneDetector::setVanishingPointMode(int mode)
+{
+	// the mode is set by init, at the next frame
+	m_msacMode = mode;
+	m_msacSize = cv::Size(0, 0);
+}
+
+void LaneDetector::setVanishingPointSeed(uint64 seed)
+{
+	// the MSAC instance is seeded by init, at the next frame
+	m_msacSeed = seed;
+	m_msacSize = cv::Size(0, 0);
+}
+
+void LaneDetector::setExhaustiveVanishingPoint(int maxLines, int topLines)
+{
+	m_msac.setExhaustive(maxLines, topLines);
+}
+
+void LaneDetector::setVanishingPointSampler(int sampler)
+{
+	m_msac.setSampler(sampler);
+}
+
+void LaneDetector::setBoundedVanishingPointScoring(bool enable)
+{
+	m_msac.setBoundedScoring(enable);
+}
+
+void LaneDetector::setVanishingPointTracking(bool enable)
+{
+	m_msac.setWarmStart(enable);
+}
+
+void LaneDetector::setVanishingPointBudget(int maxIterations, double maxMilliseconds)
+{
+	// the budget of the branch and bound is set for each frame, from what is left
+	m_msac.setBudget(maxIterations, maxMilliseconds);
+	m_budgetIterations = std::max(maxIterations, 0);
+	m_budgetMilliseconds = std::max(maxMilliseconds, 0.0);
+}
+
+void LaneDetector::setVanishingPointFallback(float minInlierRatio)
+{
+	m_fallbackInlierRatio = minInlierRatio;
+}
+
+const MSACStats& LaneDetector::getVanishingPointStats() const
+{
+	return m_vanishingPointStats;
+}
+
+SegmentDetector& LaneDetector::segmentDetector()
+{
+	if (m_segmentDetectorMode == SEGMENT_DETECTOR_REGION) return m_regionSegmentDetector;
+	return m_houghSegmentDetector;
+}
+
+void LaneDetector::setPyramidLevel(int pyramidLevel)
+{
+	CV_Assert(pyramidLevel >= 0 && pyramidLevel <= 2);
+	m_pyramidLevel = pyramidLevel;
+}
+
+bool LaneDetector::detect(const cv::Mat& cameraImg, 
+			  struct lane& leftLane, 
+			  struct lane& rightLane)
+{
+	int horizonRow = m_horizonRow;
+	if (m_trackHorizon && m_hasLastVanishingPoint) {
+		horizonRow = std::max(horizonRow, m_lastVanishingPoint.y);
+	}
+	// a failed frame searches the whole image below the fixed horizon again
+	m_hasLastVanishingPoint = false;
+
+	struct laneDetectorLine left, right;
+	if (m_pyramidLevel > 0) {
+		if (!detectLeftAndRightLanePyramid(cameraImg, left, right, horizonRow, m_pyramidLevel)) return false;
+	} else {
+		if (!detectLeftAndRightLane(cameraImg, left, right, horizonRow, 0)) return false;
+	}
+	m_lastVanishingPoint = left.top;
+	m_hasLastVanishingPoint = true;
 
 	lineConvert(left, leftLane);
 	lineConvert(right, rightLane);
@@ -258,11 +621,12 @@ bool getLeftAndRightLane(const cv::Mat& cameraImg,
  * @param[in] leftLane the left lane of the road
  * @param[out] rightLane the right lane of the road
  */
-void getRoadRoi(const cv::Mat& srcImg, cv::Mat& roadRoiImg, 
-		struct lane& leftLane, 
-		struct lane& rightLane) 
+void LaneDetector::getRoadRoi(const cv::Mat& srcImg, cv::Mat& roadRoiImg, 
+			      struct lane& leftLane, 
+			      struct lane& rightLane) 
 {
-	cv::Mat maskImg(srcImg.size(), CV_8UC1);
+	cv::Mat& maskImg = m_maskImg;
+	maskImg.create(srcImg.size(), CV_8UC1);
 	maskImg.setTo(0);
 
 	cv::line(maskImg, leftLane.m_top, leftLane.m_bottom, cv::Scalar::all(255), 1);
@@ -271,14 +635,17 @@ void getRoadRoi(const cv::Mat& srcImg, cv::Mat& roadRoiImg,
 	cv::Point seedPoint(maskImg.cols / 2, maskImg.rows / 2);
 	cv::floodFill(maskImg, seedPoint, cv::Scalar::all(255));
 
+	// copyTo only clears a newly allocated roadRoiImg
+	roadRoiImg.create(srcImg.size(), srcImg.type());
+	roadRoiImg.setTo(0);
 	srcImg.copyTo(roadRoiImg, maskImg);
 }
 
-bool getRoadRoiImage(const cv::Mat& cameraImg,
-		     cv::Mat& roadImg)
+bool LaneDetector::getRoadRoiImage(const cv::Mat& cameraImg,
+				   cv::Mat& roadImg)
 {
 	struct lane leftLane, rightLane;
-	if (!getLeftAndRightLane(cameraImg, leftLane, rightLane)) {
+	if (!detect(cameraImg, leftLane, rightLane)) {
 		return false;
 	}
 	getRoadRoi(cameraImg, roadImg, leftLane, rightLane);
@@ -366,14 +733,15 @@ void getMarkerImage(cv::Mat& roadRoiImg,
 	}
 }
 
-bool getMiddleLane(const cv::Mat& roadRoiImage,
-		   cv::Mat& markerImg, 
-		   cv::Point& middleLaneBottom)
+bool LaneDetector::getMiddleLane(const cv::Mat& roadRoiImage,
+				 cv::Mat& markerImg, 
+				 cv::Point& middleLaneBottom)
 {
 	cv::watershed(roadRoiImage, markerImg);
 
 	// get the watershed boundary
-	cv::Mat maskImg(roadRoiImage.size(), CV_8UC1);
+	cv::Mat& maskImg = m_watershedMask;
+	maskImg.create(roadRoiImage.size(), CV_8UC1);
 	maskImg.setTo(0);
 	// here start from 5, remove the boundary of the image
 	for (int r = 5; r < markerImg.rows - 5; ++r) {
@@ -388,7 +756,8 @@ bool getMiddleLane(const cv::Mat& roadRoiImage,
 	}
 
 	int houghThreshold = 70;
-	std::vector<cv::Vec4i> lines;
+	std::vector<cv::Vec4i>& lines = m_middleLines;
+	lines.clear();
 	cv::HoughLinesP(maskImg, lines, 1, CV_PI / 180, houghThreshold, 10, 10);
 	if (lines.size() == 0) return false;
 
@@ -411,18 +780,18 @@ bool getMiddleLane(const cv::Mat& roadRoiImage,
 	return true;
 }
 
-bool getThreeLane(const cv::Mat& cameraImg,
-		  struct lane& leftLane,
-		  struct lane& middleLane,
-		  struct lane& rightLane)
+bool LaneDetector::detect(const cv::Mat& cameraImg,
+			  struct lane& leftLane,
+			  struct lane& middleLane,
+			  struct lane& rightLane)
 {
-	if (!getLeftAndRightLane(cameraImg, leftLane, rightLane)) {
+	if (!detect(cameraImg, leftLane, rightLane)) {
 		return false;
 	}
-	cv::Mat roadRoiImage;
+	cv::Mat& roadRoiImage = m_roadRoiImg;
 	getRoadRoi(cameraImg, roadRoiImage, leftLane, rightLane);
 
-	cv::Mat markerImg;  // marker image for watershed algorithm
+	cv::Mat& markerImg = m_markerImg;  // marker image for watershed algorithm
 	getMarkerImage(roadRoiImage, leftLane, rightLane, markerImg);
 
 	cv::Point middleLaneBottom;
@@ -442,4 +811,41 @@ bool getThreeLane(const cv::Mat& cameraImg,
 	return true;
 }
 
+// the stateless interface
+bool getLeftAndRightLane(const cv::Mat& cameraImg, 
+		         struct lane& leftLane, 
+			 struct lane& rightLane,
+			 int horizonRow,
+			 int pyramidLevel)
+{
+	LaneDetector detector;
+	detector.setHorizonRow(horizonRow);
+	detector.setPyramidLevel(pyramidLevel);
+	return detector.detect(cameraImg, leftLane, rightLane);
+}
+
+bool getThreeLane(const cv::Mat& cameraImg,
+		  struct lane& leftLane,
+		  struct lane& middleLane,
+		  struct lane& rightLane,
+		  int horizonRow,
+		  int pyramidLevel)
+{
+	LaneDetector detector;
+	detector.setHorizonRow(horizonRow);
+	detector.setPyramidLevel(pyramidLevel);
+	return detector.detect(cameraImg, leftLane, middleLane, rightLane);
+}
+
+bool getRoadRoiImage(const cv::Mat& cameraImg,
+		     cv::Mat& roadImg,
+		     int horizonRow,
+		     int pyramidLevel)
+{
+	LaneDetector detector;
+	detector.setHorizonRow(horizonRow);
+	detector.setPyramidLevel(pyramidLevel);
+	return detector.getRoadRoiImage(cameraImg, roadImg);
+}
+
 }
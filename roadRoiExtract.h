@@ -2,6 +2,9 @@
 #define _ROAD_ROI_EXTRACT_H_
 
 #include <opencv2/opencv.hpp>
+#include "MSAC.h"
+#include "segmentDetector.h"
+#include "segmentMerger.h"
 
 namespace gentech
 {
@@ -12,16 +15,34 @@ struct lane
 	cv::Point m_bottom;
 };
 
+/**
+ * used internal for finding the left and right lane.
+ */ 
+struct laneDetectorLine
+{
+	cv::Point top;
+	cv::Point bottom;
+	double angle;
+};
+
 /**
  * detect the left lane and right lane of the road in the cameraImg.
  *
  * @param roadImg the original road image
  * @param leftLane the detected left lane of the road image
  * @param rightLane the detected right lane of the road image
+ * @param horizonRow the lanes are only searched in the rows below it, which can be
+ *                   the fixed horizon of the camera or the m_top.y of the lanes
+ *                   detected in the last frame. 0 searches the whole image.
+ * @param pyramidLevel if larger than 0, the lanes are detected in the image downscaled
+ *                     by 2^pyramidLevel (1 or 2), then refined at full resolution in
+ *                     narrow bands around the coarse lanes.
  */
 bool getLeftAndRightLane(const cv::Mat& cameraImg, 
 		         struct lane& leftLane, 
-			 struct lane& rightLane);
+			 struct lane& rightLane,
+			 int horizonRow = 0,
+			 int pyramidLevel = 0);
 
 /**
  * detect the left lane and right lane of the road in the cameraImg.
@@ -30,18 +51,239 @@ bool getLeftAndRightLane(const cv::Mat& cameraImg,
  * @param leftLane the detected left lane of the road image
  * @param middleLane the detected middle lane of the road image
  * @param rightLane the detected right lane of the road image
+ * @param horizonRow the lanes are only searched in the rows below it, see getLeftAndRightLane
+ * @param pyramidLevel coarse to fine detection of the left and right lane, see getLeftAndRightLane
  */
 bool getThreeLane(const cv::Mat& cameraImg, 
 		  struct lane& leftLane, 
 	          struct lane& middleLane, 
-		  struct lane& rightLane);
+		  struct lane& rightLane,
+		  int horizonRow = 0,
+		  int pyramidLevel = 0);
 
 /**
  * extract the road roi image from the original camera image.
+ *
+ * @param horizonRow the lanes are only searched in the rows below it, see getLeftAndRightLane
+ * @param pyramidLevel coarse to fine detection of the lanes, see getLeftAndRightLane
  */
 bool getRoadRoiImage(const cv::Mat& cameraImg,
-		     cv::Mat& roadImg);
+		     cv::Mat& roadImg,
+		     int horizonRow = 0,
+		     int pyramidLevel = 0);
+
+/**
+ * detect the lanes in the frames of one camera.
+ *
+ * The images, line buffers and the MSAC instance of every stage are kept between the
+ * frames and only reallocated when the frame size changes, so a LaneDetector should be
+ * reused for all the frames of a camera instead of calling the free functions above.
+ * The vanishing points are also written into matrices owned by the MSAC instances.
+ */
+class LaneDetector
+{
+public:
+	LaneDetector();
+
+	/**
+	 * the lanes are only searched in the rows below horizonRow, see getLeftAndRightLane.
+	 */
+	void setHorizonRow(int horizonRow);
+
+	/**
+	 * if enabled, the vanishing point of the last detected frame is used as the horizon,
+	 * the row set by setHorizonRow is used after a failed frame.
+	 */
+	void setHorizonTracking(bool enable);
+
+	/**
+	 * the orientations of the lines searched by the hough transform, see LineHough::setOrientationRanges.
+	 * All orientations are searched by default. The rejection rules of lineDetector (|dy| < 10 and
+	 * |dx| < 5) depend on the line length, so near the diagonal of the image they only exclude a band
+	 * narrower than one degree. A camera with known lane directions can set a prior, e.g. (3, 89) and
+	 * (91, 177), which also drops the long lines close to horizontal or vertical.
+	 */
+	void setOrientationRanges(const std::vector<cv::Vec2f>& ranges);
+
+	/**
+	 * if enabled, the local orientation of the line candidates is estimated in the line filter pass
+	 * and each candidate only votes for the hough lines within toleranceDegrees of it.
+	 * The voting is much cheaper and the peaks are sharper, disabled by default.
+	 */
+	void setOrientationGuidedVoting(bool enable, int toleranceDegrees = 5);
+
+	/**
+	 * the detector of the line segments, SEGMENT_DETECTOR_HOUGH (default) or SEGMENT_DETECTOR_REGION.
+	 * The region detector grows the line support regions of the candidates in linear time,
+	 * the hough detector is more robust to the gaps of the dashed lines.
+	 */
+	void setSegmentDetector(int mode);
+
+	/**
+	 * if enabled, the collinear fragments of a line marking are merged into one segment before
+	 * the vanishing point estimation, see SegmentMerger. Disabled by default.
+	 */
+	void setSegmentMerging(bool enable);
+
+	/**
+	 * if enabled, the hypotheses of the vanishing point are scored in parallel batches, see MSAC::setParallel.
+	 * The result only depends on the seed, not on the number of threads. Disabled by default.
+	 */
+	void setParallelVanishingPoint(bool enable);
+
+	/**
+	 * the estimator of the vanishing point, MODE_NIETO (default) or MODE_ACCUMULATOR, see MSAC::init.
+	 * The accumulator has no random iterations, so its time only depends on the number of segments.
+	 */
+	void setVanishingPointMode(int mode);
+
+	/**
+	 * the seed of the random hypotheses of the vanishing point, the frames that follow give the same
+	 * results in every run. Each LaneDetector has its own generator.
+	 */
+	void setVanishingPointSeed(uint64 seed);
 
+	/**
+	 * up to maxLines line segments, the vanishing point is searched on all the pairs of segments (or of the
+	 * topLines longest ones) instead of random samples, see MSAC::setExhaustive. Disabled by default (0).
+	 */
+	void setExhaustiveVanishingPoint(int maxLines, int topLines = 0);
+
+	/**
+	 * the sampler of the vanishing point, SAMPLER_UNIFORM (default) or SAMPLER_PROSAC, see MSAC::setSampler.
+	 * PROSAC starts with the longest segments, which are nearly always lane markings.
+	 */
+	void setVanishingPointSampler(int sampler);
+
+	/**
+	 * if enabled, the scoring of a vanishing point hypothesis stops once it can not beat the best one,
+	 * see MSAC::setBoundedScoring. The result is the same. Disabled by default.
+	 */
+	void setBoundedVanishingPointScoring(bool enable);
+
+	/**
+	 * if enabled, the vanishing point of the last frame and its best hypotheses are scored first and the
+	 * sampling is cut short while they still explain the line segments, see MSAC::setWarmStart.
+	 * Disabled by default.
+	 */
+	void setVanishingPointTracking(bool enable);
+
+	/**
+	 * bounds the vanishing point search of a frame to maxIterations hypotheses and maxMilliseconds,
+	 * see MSAC::setBudget. The fallback of setVanishingPointFallback only gets what the first search left,
+	 * and is skipped if nothing is left. 0 means no limit (default).
+	 */
+	void setVanishingPointBudget(int maxIterations, double maxMilliseconds = 0);
+
+	/**
+	 * if the vanishing point is not found or has less than minInlierRatio of the segments as inliers,
+	 * it is searched again with MODE_BRANCH_AND_BOUND, which finds the one with the most inliers.
+	 * Both searches share the budget of setVanishingPointBudget. Disabled by default (0).
+	 */
+	void setVanishingPointFallback(float minInlierRatio);
+
+	/**
+	 * the iterations, elapsed time and truncation flag of the vanishing point search of the last frame.
+	 * If the branch and bound was used, the iterations and the time are the sums of both searches,
+	 * the flags are the ones of the branch and bound. truncated is also set if the budget left nothing for it.
+	 */
+	const MSACStats& getVanishingPointStats() const;
+
+	/**
+	 * coarse to fine detection of the left and right lane, see getLeftAndRightLane.
+	 */
+	void setPyramidLevel(int pyramidLevel);
+
+	/**
+	 * detect the left lane and right lane of the road in the cameraImg.
+	 */
+	bool detect(const cv::Mat& cameraImg, 
+		    struct lane& leftLane, 
+		    struct lane& rightLane);
+
+	/**
+	 * detect the left, middle and right lane of the road in the cameraImg.
+	 */
+	bool detect(const cv::Mat& cameraImg, 
+		    struct lane& leftLane, 
+		    struct lane& middleLane, 
+		    struct lane& rightLane);
+
+	/**
+	 * extract the road roi image from the original camera image.
+	 */
+	bool getRoadRoiImage(const cv::Mat& cameraImg,
+			     cv::Mat& roadImg);
+
+private:
+	SegmentDetector& segmentDetector();
+	void getLineCandidatesImg(const cv::Mat& srcImg, cv::Mat& dstGray, int laneMarkingWidth, int horizonRow,
+				  cv::Mat* orientationImg);
+	void lineDetector(cv::Mat& img, std::vector<cv::Vec4i>& lines, int horizonRow, int pyramidLevel,
+			  const cv::Mat* orientationImg);
+	int lineFilter(std::vector<cv::Vec4i>& lines, cv::Size imgSize, std::vector<struct laneDetectorLine>& lineFiltered);
+	bool detectLeftAndRightLane(const cv::Mat& img, struct laneDetectorLine& left, struct laneDetectorLine& right,
+				    int horizonRow, int pyramidLevel);
+	bool refineLane(const cv::Mat& cameraImg, const struct laneDetectorLine& coarse, const struct laneDetectorLine& other,
+			int bandWidth, int startRow, int laneMarkingWidth, cv::Vec4f& fitted);
+	bool detectLeftAndRightLanePyramid(const cv::Mat& cameraImg, struct laneDetectorLine& left, struct laneDetectorLine& right,
+					   int horizonRow, int pyramidLevel);
+	void getRoadRoi(const cv::Mat& srcImg, cv::Mat& roadRoiImg, struct lane& leftLane, struct lane& rightLane);
+	bool getMiddleLane(const cv::Mat& roadRoiImage, cv::Mat& markerImg, cv::Point& middleLaneBottom);
+
+	// settings
+	int m_horizonRow;
+	int m_pyramidLevel;
+	bool m_trackHorizon;
+	int m_segmentDetectorMode;
+	bool m_mergeSegments;
+
+	// state of the last frame
+	bool m_hasLastVanishingPoint;
+	cv::Point m_lastVanishingPoint;
+
+	// left and right lane
+	cv::Mat m_grayRows;
+	std::vector<const unsigned char*> m_grayRowPtrs;
+	cv::Mat m_lineCandidateImg;
+	cv::Mat m_orientationImg;
+	cv::Mat m_smallImg;
+	HoughSegmentDetector m_houghSegmentDetector;
+	RegionSegmentDetector m_regionSegmentDetector;
+	SegmentMerger m_segmentMerger;
+	std::vector<cv::Vec4i> m_linesTmp;
+	std::vector<cv::Vec4i> m_rawLines;
+	std::vector<struct laneDetectorLine> m_lineFiltered;
+
+	// vanishing point
+	MSAC m_msac;
+	cv::Size m_msacSize;
+	int m_msacMode;
+	uint64 m_msacSeed;
+	MSAC m_msacFallback;
+	float m_fallbackInlierRatio;
+	int m_budgetIterations;
+	double m_budgetMilliseconds;
+	MSACStats m_vanishingPointStats;
+	std::vector<int> m_clusterIndices;
+	std::vector<int> m_clusterOffsets;
+	std::vector<int> m_numInliers;
+	std::vector<cv::Mat> m_vps;
+
+	// refinement of the pyramid mode
+	std::vector<unsigned char> m_bandGray;
+	std::vector<unsigned char> m_bandResponse;
+	std::vector<cv::Point> m_bandCandidates;
+	std::vector<unsigned char> m_bandCandidateResponses;
+	std::vector<cv::Point> m_bandPoints;
+
+	// road roi and middle lane
+	cv::Mat m_maskImg;
+	cv::Mat m_roadRoiImg;
+	cv::Mat m_markerImg;
+	cv::Mat m_watershedMask;
+	std::vector<cv::Vec4i> m_middleLines;
+};
 
 }
 
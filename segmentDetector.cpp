@@ -0,0 +1,185 @@
+#include "segmentDetector.h"
+#include "ridgeFilter.h"
+#include <algorithm>
+
+namespace gentech
+{
+
+HoughSegmentDetector::HoughSegmentDetector()
+	: m_orientationGuided(false)
+{
+}
+
+void HoughSegmentDetector::setOrientationRanges(const std::vector<cv::Vec2f>& ranges)
+{
+	m_lineHough.setOrientationRanges(ranges);
+}
+
+void HoughSegmentDetector::setOrientationGuidedVoting(bool enable, int toleranceDegrees)
+{
+	m_orientationGuided = enable;
+	m_lineHough.setOrientationTolerance(toleranceDegrees);
+}
+
+bool HoughSegmentDetector::needsOrientation() const
+{
+	return m_orientationGuided;
+}
+
+void HoughSegmentDetector::detect(cv::Mat& candidates, const cv::Mat* orientation, std::vector<cv::Vec4i>& lines,
+				  int maxLines, int pyramidLevel)
+{
+	int houghThreshold = 70 >> pyramidLevel;
+	int minLineLength = 20 >> pyramidLevel;
+	int maxLineGap = 10 >> pyramidLevel;
+	m_lineHough.setParams(houghThreshold, minLineLength, maxLineGap);
+	m_lineHough.detect(candidates, lines, maxLines, m_orientationGuided ? orientation : NULL);
+}
+
+RegionSegmentDetector::RegionSegmentDetector()
+	: m_angleTolerance(10),
+	  m_allowed(180, 1)
+{
+	// the orientations are axial, so the region orientation is averaged on the doubled angles
+	m_cos2.resize(180);
+	m_sin2.resize(180);
+	for (int n = 0; n < 180; ++n) {
+		m_cos2[n] = (float)cos(2 * n * CV_PI / 180);
+		m_sin2[n] = (float)sin(2 * n * CV_PI / 180);
+	}
+}
+
+void RegionSegmentDetector::setAngleTolerance(int degrees)
+{
+	m_angleTolerance = std::max(0, std::min(degrees, 90));
+}
+
+void RegionSegmentDetector::setOrientationRanges(const std::vector<cv::Vec2f>& ranges)
+{
+	// the orientation image holds the angle of the line normal
+	for (int n = 0; n < 180; ++n) m_allowed[n] = isOrientationInRanges((float)((n + 90) % 180), ranges) ? 1 : 0;
+}
+
+bool RegionSegmentDetector::needsOrientation() const
+{
+	return true;
+}
+
+bool RegionSegmentDetector::segmentCompare(const segment& a, const segment& b)
+{
+	return a.support > b.support;
+}
+
+/**
+ * grow the region of the seed (x, y) into m_region, its pixels are cleared in candidates.
+ */
+void RegionSegmentDetector::growRegion(cv::Mat& candidates, const cv::Mat& orientation, int x, int y)
+{
+	m_region.clear();
+	m_region.push_back(cv::Point(x, y));
+	candidates.at<unsigned char>(y, x) = 0;
+
+	int theta = orientation.at<unsigned char>(y, x);
+	float sumCos = m_cos2[theta], sumSin = m_sin2[theta];
+	for (std::size_t i = 0; i < m_region.size(); ++i) {
+		cv::Point p = m_region[i];
+		for (int dy = -1; dy <= 1; ++dy) {
+			int yn = p.y + dy;
+			if (yn < 0 || yn >= candidates.rows) continue;
+			unsigned char* pCandidates = candidates.ptr<unsigned char>(yn);
+			const unsigned char* pOrientation = orientation.ptr<unsigned char>(yn);
+			for (int dx = -1; dx <= 1; ++dx) {
+				int xn = p.x + dx;
+				if (xn < 0 || xn >= candidates.cols || pCandidates[xn] == 0) continue;
+
+				int o = pOrientation[xn];
+				if (o != RIDGE_NO_ORIENTATION) {
+					int diff = std::abs(o - theta);
+					if (std::min(diff, 180 - diff) > m_angleTolerance) continue;
+					sumCos += m_cos2[o];
+					sumSin += m_sin2[o];
+					theta = cvRound(atan2(sumSin, sumCos) * 90 / CV_PI);
+					if (theta < 0) theta += 180;
+					if (theta >= 180) theta -= 180;
+				}
+				pCandidates[xn] = 0;
+				m_region.push_back(cv::Point(xn, yn));
+			}
+		}
+	}
+}
+
+/**
+ * the principal axis of m_region, clipped to the projections of its pixels.
+ *
+ * @return false if the region is shorter than minLineLength
+ */
+bool RegionSegmentDetector::fitSegment(int minLineLength, cv::Vec4i& line) const
+{
+	double n = (double)m_region.size();
+	double mx = 0, my = 0;
+	for (std::size_t i = 0; i < m_region.size(); ++i) {
+		mx += m_region[i].x;
+		my += m_region[i].y;
+	}
+	mx /= n;
+	my /= n;
+
+	double sxx = 0, syy = 0, sxy = 0;
+	for (std::size_t i = 0; i < m_region.size(); ++i) {
+		double dx = m_region[i].x - mx, dy = m_region[i].y - my;
+		sxx += dx * dx;
+		syy += dy * dy;
+		sxy += dx * dy;
+	}
+	double angle = 0.5 * atan2(2 * sxy, sxx - syy);
+	double ux = cos(angle), uy = sin(angle);
+
+	double tMin = 0, tMax = 0;
+	for (std::size_t i = 0; i < m_region.size(); ++i) {
+		double t = (m_region[i].x - mx) * ux + (m_region[i].y - my) * uy;
+		tMin = std::min(tMin, t);
+		tMax = std::max(tMax, t);
+	}
+	line = cv::Vec4i(cvRound(mx + tMin * ux), cvRound(my + tMin * uy),
+			 cvRound(mx + tMax * ux), cvRound(my + tMax * uy));
+	return std::abs(line[2] - line[0]) >= minLineLength || std::abs(line[3] - line[1]) >= minLineLength;
+}
+
+void RegionSegmentDetector::detect(cv::Mat& candidates, const cv::Mat* orientation, std::vector<cv::Vec4i>& lines,
+				   int maxLines, int pyramidLevel)
+{
+	CV_Assert(candidates.type() == CV_8UC1);
+	CV_Assert(orientation != NULL && orientation->type() == CV_8UC1 && orientation->size() == candidates.size());
+
+	// a region covers the width of the marking, so its support shrinks with the area
+	int minSupport = std::max(70 >> (2 * pyramidLevel), 2);
+	int minLineLength = 20 >> pyramidLevel;
+
+	// every pixel is visited once as a seed and once as a neighbour of each region it joins
+	m_segments.clear();
+	for (int y = 0; y < candidates.rows; ++y) {
+		const unsigned char* pCandidates = candidates.ptr<unsigned char>(y);
+		const unsigned char* pOrientation = orientation->ptr<unsigned char>(y);
+		for (int x = 0; x < candidates.cols; ++x) {
+			if (pCandidates[x] == 0) continue;
+			// a candidate has no orientation when the gray ring around it is flat, it does not seed a region
+			int o = pOrientation[x];
+			if (o == RIDGE_NO_ORIENTATION || !m_allowed[o]) continue;
+
+			growRegion(candidates, *orientation, x, y);
+			segment s;
+			s.support = (int)m_region.size();
+			if (s.support < minSupport || !fitSegment(minLineLength, s.line)) continue;
+			m_segments.push_back(s);
+		}
+	}
+
+	std::stable_sort(m_segments.begin(), m_segments.end(), segmentCompare);
+	lines.clear();
+	for (std::size_t i = 0; i < m_segments.size() && (int)lines.size() < maxLines; ++i) {
+		lines.push_back(m_segments[i].line);
+	}
+}
+
+}
@@ -0,0 +1,116 @@
+#ifndef _SEGMENT_DETECTOR_H_
+#define _SEGMENT_DETECTOR_H_
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include "lineHough.h"
+
+namespace gentech
+{
+
+#define SEGMENT_DETECTOR_HOUGH		(0)
+#define SEGMENT_DETECTOR_REGION		(1)
+
+/**
+ * the stage between the line candidates image and the vanishing point filter,
+ * it turns the line candidates into line segments.
+ */
+class SegmentDetector
+{
+public:
+	virtual ~SegmentDetector() {}
+
+	/**
+	 * restrict the orientations of the detected segments, see LineHough::setOrientationRanges.
+	 */
+	virtual void setOrientationRanges(const std::vector<cv::Vec2f>& ranges) = 0;
+
+	/**
+	 * @return true if detect needs the line orientation of the candidates
+	 */
+	virtual bool needsOrientation() const = 0;
+
+	/**
+	 * detect the line segments of the line candidates.
+	 *
+	 * @param[in, out] candidates the binary line candidates image, the pixels may be cleared
+	 * @param[in] orientation the line orientation of every pixel of candidates (see ridgeOrientationRow),
+	 *                        NULL if needsOrientation is false
+	 * @param[out] lines the detected segments, strongest first
+	 * @param[in] maxLines the maximum number of segments
+	 * @param[in] pyramidLevel candidates is downscaled by 2^pyramidLevel, the length thresholds are scaled with it
+	 */
+	virtual void detect(cv::Mat& candidates, const cv::Mat* orientation, std::vector<cv::Vec4i>& lines,
+			    int maxLines, int pyramidLevel) = 0;
+};
+
+/**
+ * the segments of the strongest hough lines, see LineHough.
+ */
+class HoughSegmentDetector : public SegmentDetector
+{
+public:
+	HoughSegmentDetector();
+
+	void setOrientationRanges(const std::vector<cv::Vec2f>& ranges);
+
+	/**
+	 * each candidate only votes for the hough lines within toleranceDegrees of its orientation.
+	 */
+	void setOrientationGuidedVoting(bool enable, int toleranceDegrees);
+
+	bool needsOrientation() const;
+	void detect(cv::Mat& candidates, const cv::Mat* orientation, std::vector<cv::Vec4i>& lines,
+		    int maxLines, int pyramidLevel);
+
+private:
+	LineHough m_lineHough;
+	bool m_orientationGuided;
+};
+
+/**
+ * line support regions like LSD, grown in linear time.
+ *
+ * Starting from each unvisited candidate, the 8 connected candidates whose orientation is within
+ * the angle tolerance of the region are added to it, the region orientation is updated on the way.
+ * The segment of a region is its principal axis, clipped to the extent of the region pixels.
+ * The regions are grown on the ridge candidates instead of the gray gradient, since a line marking
+ * is one ridge but two gradient edges.
+ */
+class RegionSegmentDetector : public SegmentDetector
+{
+public:
+	RegionSegmentDetector();
+
+	/**
+	 * @param degrees the maximum orientation difference of a pixel to its region
+	 */
+	void setAngleTolerance(int degrees);
+
+	void setOrientationRanges(const std::vector<cv::Vec2f>& ranges);
+	bool needsOrientation() const;
+	void detect(cv::Mat& candidates, const cv::Mat* orientation, std::vector<cv::Vec4i>& lines,
+		    int maxLines, int pyramidLevel);
+
+private:
+	struct segment
+	{
+		int support;	// the number of pixels in the region
+		cv::Vec4i line;
+	};
+	static bool segmentCompare(const segment& a, const segment& b);
+
+	void growRegion(cv::Mat& candidates, const cv::Mat& orientation, int x, int y);
+	bool fitSegment(int minLineLength, cv::Vec4i& line) const;
+
+	int m_angleTolerance;
+	std::vector<unsigned char> m_allowed;	// the seed orientations, one per degree
+	std::vector<float> m_cos2;
+	std::vector<float> m_sin2;
+	std::vector<cv::Point> m_region;
+	std::vector<segment> m_segments;
+};
+
+}
+
+#endif /* _SEGMENT_DETECTOR_H_ */
@@ -0,0 +1,192 @@
+#include "segmentMerger.h"
+#include <algorithm>
+#include <cfloat>
+
+namespace gentech
+{
+
+bool SegmentMerger::cellEntry::operator<(const cellEntry& other) const
+{
+	if (angleCell != other.angleCell) return angleCell < other.angleCell;
+	if (rhoCell != other.rhoCell) return rhoCell < other.rhoCell;
+	return index < other.index;
+}
+
+SegmentMerger::SegmentMerger()
+{
+	setParams(2, 3, 10);
+}
+
+void SegmentMerger::setParams(float maxAngle, float maxDistance, float maxGap)
+{
+	m_maxAngle = std::max(maxAngle, 0.1f);
+	m_maxDistance = std::max(maxDistance, 0.0f);
+	m_maxGap = std::max(maxGap, 0.0f);
+	// the cells are at least maxAngle wide, so the matching angles are in the neighbouring cells
+	m_numAngleCells = std::max((int)(180 / m_maxAngle), 1);
+	m_angleCellWidth = 180.0f / m_numAngleCells;
+}
+
+int SegmentMerger::find(int i)
+{
+	while (m_parent[i] != i) {
+		m_parent[i] = m_parent[m_parent[i]];
+		i = m_parent[i];
+	}
+	return i;
+}
+
+void SegmentMerger::unite(int i, int j)
+{
+	// the root is the first fragment of the group, it keeps the order of the segments
+	int a = find(i), b = find(j);
+	if (a < b) m_parent[b] = a;
+	else if (b < a) m_parent[a] = b;
+}
+
+bool SegmentMerger::isCollinear(const std::vector<cv::Vec4i>& lines, int i, int j) const
+{
+	float diff = std::abs(m_angle[i] - m_angle[j]);
+	if (std::min(diff, 180 - diff) > m_maxAngle) return false;
+
+	// the end points of the shorter fragment should be on the line of the longer one
+	if (m_length[i] < m_length[j]) std::swap(i, j);
+	cv::Point2f u = m_direction[i];
+	cv::Point2f a(lines[i][0], lines[i][1]), b(lines[j][0], lines[j][1]), c(lines[j][2], lines[j][3]);
+	cv::Point2f ab = b - a, ac = c - a;
+	if (std::abs(u.x * ab.y - u.y * ab.x) > m_maxDistance) return false;
+	if (std::abs(u.x * ac.y - u.y * ac.x) > m_maxDistance) return false;
+
+	// the gap between the projections on the longer one
+	float t0 = ab.x * u.x + ab.y * u.y, t1 = ac.x * u.x + ac.y * u.y;
+	float tMin = std::min(t0, t1), tMax = std::max(t0, t1);
+	cv::Point2f e(lines[i][2] - lines[i][0], lines[i][3] - lines[i][1]);
+	float s0 = 0, s1 = e.x * u.x + e.y * u.y;
+	float sMin = std::min(s0, s1), sMax = std::max(s0, s1);
+	return std::max(tMin, sMin) - std::min(tMax, sMax) <= m_maxGap;
+}
+
+void SegmentMerger::compareCell(const std::vector<cv::Vec4i>& lines, int i, int angleCell, int rhoCell)
+{
+	cellEntry probe;
+	probe.angleCell = angleCell;
+	probe.rhoCell = rhoCell;
+	probe.index = i + 1;
+	// only the later segments, every pair is compared once
+	std::vector<cellEntry>::const_iterator it = std::lower_bound(m_cells.begin(), m_cells.end(), probe);
+	for (; it != m_cells.end() && it->angleCell == angleCell && it->rhoCell == rhoCell; ++it) {
+		if (find(i) != find(it->index) && isCollinear(lines, i, it->index)) unite(i, it->index);
+	}
+}
+
+void SegmentMerger::merge(std::vector<cv::Vec4i>& lines)
+{
+	int n = (int)lines.size();
+	if (n < 2) return;
+
+	m_origin = cv::Point2f(0, 0);
+	for (int i = 0; i < n; ++i) {
+		m_origin.x += (lines[i][0] + lines[i][2]) * 0.5f / n;
+		m_origin.y += (lines[i][1] + lines[i][3]) * 0.5f / n;
+	}
+	float radius = 0;
+	m_angle.resize(n);
+	m_direction.resize(n);
+	m_rho.resize(n);
+	m_length.resize(n);
+	for (int i = 0; i < n; ++i) {
+		float dx = (float)(lines[i][2] - lines[i][0]), dy = (float)(lines[i][3] - lines[i][1]);
+		float angle = (float)(atan2(dy, dx) * 180 / CV_PI);
+		if (angle < 0) angle += 180;
+		if (angle >= 180) angle -= 180;
+		m_angle[i] = angle;
+		m_direction[i] = cv::Point2f((float)cos(angle * CV_PI / 180), (float)sin(angle * CV_PI / 180));
+		m_length[i] = std::sqrt(dx * dx + dy * dy);
+		cv::Point2f p(lines[i][0] - m_origin.x, lines[i][1] - m_origin.y);
+		m_rho[i] = m_direction[i].x * p.y - m_direction[i].y * p.x;
+		radius = std::max(radius, std::sqrt(p.x * p.x + p.y * p.y));
+		radius = std::max(radius, std::sqrt((p.x + dx) * (p.x + dx) + (p.y + dy) * (p.y + dy)));
+	}
+	// the rho of two matching lines differs by the end point distance and the rotation of the
+	// normal by maxAngle at the distance of the end points from the origin
+	m_rhoCellWidth = m_maxDistance + 2 * radius * (float)sin(m_maxAngle * CV_PI / 360) + 1;
+
+	m_cells.resize(n);
+	m_parent.resize(n);
+	for (int i = 0; i < n; ++i) {
+		m_cells[i].angleCell = std::min((int)(m_angle[i] / m_angleCellWidth), m_numAngleCells - 1);
+		m_cells[i].rhoCell = (int)floor(m_rho[i] / m_rhoCellWidth);
+		m_cells[i].index = i;
+		m_parent[i] = i;
+	}
+	std::sort(m_cells.begin(), m_cells.end());
+
+	for (int i = 0; i < n; ++i) {
+		int angleCell = std::min((int)(m_angle[i] / m_angleCellWidth), m_numAngleCells - 1);
+		for (int da = -1; da <= 1; ++da) {
+			int a = angleCell + da;
+			float rho = m_rho[i];
+			// across 0 and 180 degrees the direction and so the sign of rho flips
+			if (a < 0 || a >= m_numAngleCells) {
+				a = (a + m_numAngleCells) % m_numAngleCells;
+				rho = -rho;
+			}
+			int rhoCell = (int)floor(rho / m_rhoCellWidth);
+			for (int dr = -1; dr <= 1; ++dr) compareCell(lines, i, a, rhoCell + dr);
+		}
+	}
+	for (int i = 0; i < n; ++i) m_parent[i] = find(i);
+
+	// the length weighted line of each group, the angles are averaged as doubled angles
+	m_groups.resize(n);
+	for (int i = 0; i < n; ++i) {
+		group& g = m_groups[i];
+		g.sumCos = g.sumSin = g.sumLength = 0;
+		g.center = cv::Point2f(0, 0);
+		g.size = 0;
+		g.tMin = FLT_MAX;
+		g.tMax = -FLT_MAX;
+	}
+	for (int i = 0; i < n; ++i) {
+		group& g = m_groups[m_parent[i]];
+		float w = m_length[i];
+		g.sumCos += w * (float)cos(m_angle[i] * CV_PI / 90);
+		g.sumSin += w * (float)sin(m_angle[i] * CV_PI / 90);
+		g.center.x += w * (lines[i][0] + lines[i][2]) * 0.5f;
+		g.center.y += w * (lines[i][1] + lines[i][3]) * 0.5f;
+		g.sumLength += w;
+		++g.size;
+	}
+	for (int i = 0; i < n; ++i) {
+		group& g = m_groups[i];
+		if (g.size < 2 || g.sumLength <= 0) continue;
+		g.center.x /= g.sumLength;
+		g.center.y /= g.sumLength;
+		float angle = 0.5f * (float)atan2(g.sumSin, g.sumCos);
+		g.direction = cv::Point2f((float)cos(angle), (float)sin(angle));
+	}
+	for (int i = 0; i < n; ++i) {
+		group& g = m_groups[m_parent[i]];
+		if (g.size < 2 || g.sumLength <= 0) continue;
+		for (int k = 0; k < 4; k += 2) {
+			float t = (lines[i][k] - g.center.x) * g.direction.x + (lines[i][k + 1] - g.center.y) * g.direction.y;
+			g.tMin = std::min(g.tMin, t);
+			g.tMax = std::max(g.tMax, t);
+		}
+	}
+
+	m_merged.clear();
+	for (int i = 0; i < n; ++i) {
+		if (m_parent[i] != i) continue;
+		const group& g = m_groups[i];
+		if (g.size < 2 || g.sumLength <= 0) {
+			m_merged.push_back(lines[i]);
+			continue;
+		}
+		m_merged.push_back(cv::Vec4i(cvRound(g.center.x + g.tMin * g.direction.x), cvRound(g.center.y + g.tMin * g.direction.y),
+					     cvRound(g.center.x + g.tMax * g.direction.x), cvRound(g.center.y + g.tMax * g.direction.y)));
+	}
+	lines.swap(m_merged);
+}
+
+}
@@ -0,0 +1,87 @@
+#ifndef _SEGMENT_MERGER_H_
+#define _SEGMENT_MERGER_H_
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+namespace gentech
+{
+
+/**
+ * merge the nearly collinear, overlapping fragments of a line into one segment.
+ *
+ * The segments are hashed by their (angle, rho) cell, so only the segments in the neighbouring
+ * cells are compared. The connected fragments are grouped by union-find, the merged segment lies
+ * on the length weighted mean line of the group and spans the projections of all its end points.
+ *
+ * The buffers are kept between the calls.
+ */
+class SegmentMerger
+{
+public:
+	SegmentMerger();
+
+	/**
+	 * @param maxAngle the maximum angle between two fragments in degrees
+	 * @param maxDistance the maximum distance of the end points of a fragment to the line of the other
+	 * @param maxGap the maximum gap between two fragments along the line
+	 */
+	void setParams(float maxAngle, float maxDistance, float maxGap);
+
+	/**
+	 * @param[in, out] lines the segments, replaced by the merged segments in the order of
+	 *                       the first fragment of each group
+	 */
+	void merge(std::vector<cv::Vec4i>& lines);
+
+private:
+	struct cellEntry
+	{
+		int angleCell;
+		int rhoCell;
+		int index;
+		bool operator<(const cellEntry& other) const;
+	};
+
+	struct group
+	{
+		int size;
+		float sumLength;
+		float sumCos;
+		float sumSin;
+		cv::Point2f center;
+		cv::Point2f direction;
+		float tMin;
+		float tMax;
+	};
+
+	int find(int i);
+	void unite(int i, int j);
+	bool isCollinear(const std::vector<cv::Vec4i>& lines, int i, int j) const;
+	void compareCell(const std::vector<cv::Vec4i>& lines, int i, int angleCell, int rhoCell);
+
+	float m_maxAngle;
+	float m_maxDistance;
+	float m_maxGap;
+
+	int m_numAngleCells;
+	float m_angleCellWidth;
+	float m_rhoCellWidth;
+	cv::Point2f m_origin;
+
+	// per segment
+	std::vector<float> m_angle;	// the direction in [0, 180) degrees
+	std::vector<cv::Point2f> m_direction;	// the unit vector of m_angle
+	std::vector<float> m_rho;	// the distance of the line to m_origin, along the normal of the direction
+	std::vector<float> m_length;
+	std::vector<int> m_parent;
+	std::vector<cellEntry> m_cells;
+
+	// per group, indexed by the root fragment
+	std::vector<group> m_groups;
+	std::vector<cv::Vec4i> m_merged;
+};
+
+}
+
+#endif /* _SEGMENT_MERGER_H_ */